@@ -0,0 +1,279 @@
+#include "ClipboardCodec.h"
+#include <QBuffer>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QSemaphore>
+#include <QThread>
+#include <QThreadPool>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <freerdp/freerdp.h>
+#include <freerdp/gdi/gdi.h>
+#include <limits>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CLIPBOARDCODEC_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using ClipboardCodec::PARALLEL_MIN_BYTES;
+
+constexpr LONG DEFAULT_IMAGE_PIXELS_PER_METER = 3780; // 96 DPI
+constexpr int PARALLEL_MIN_ROWS = 64; // 1つのタスクが受け持つ最小の行数
+// QtのPNGの品質は(100 - quality) * 9 / 91でzlibの圧縮レベルになる。80ならレベル1。
+constexpr int PNG_QUALITY = 80;
+
+// 32bitの画素の上位バイト(メモリ上の4バイト目)をandしてorする
+using Row32 = void (*)(uint32_t *dst, uint32_t const *src, int n, uint32_t and_mask, uint32_t or_mask);
+// 24bit(B,G,R)を32bit(B,G,R,0xff)へ広げる
+using Row24 = void (*)(uint32_t *dst, uchar const *src, int n);
+
+void row32Scalar(uint32_t *dst, uint32_t const *src, int n, uint32_t and_mask, uint32_t or_mask)
+{
+	for (int i = 0; i < n; i++) {
+		dst[i] = (src[i] & and_mask) | or_mask;
+	}
+}
+
+void row24Scalar(uint32_t *dst, uchar const *src, int n)
+{
+	for (int i = 0; i < n; i++) {
+		dst[i] = 0xff000000u | (uint32_t(src[2]) << 16) | (uint32_t(src[1]) << 8) | src[0];
+		src += 3;
+	}
+}
+
+#ifdef CLIPBOARDCODEC_X86
+
+__attribute__((target("sse2"))) void row32SSE2(uint32_t *dst, uint32_t const *src, int n, uint32_t and_mask, uint32_t or_mask)
+{
+	const __m128i a = _mm_set1_epi32(int(and_mask));
+	const __m128i o = _mm_set1_epi32(int(or_mask));
+	int i = 0;
+	for (; i + 4 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(_mm_and_si128(v, a), o));
+	}
+	row32Scalar(dst + i, src + i, n - i, and_mask, or_mask);
+}
+
+__attribute__((target("avx2"))) void row32AVX2(uint32_t *dst, uint32_t const *src, int n, uint32_t and_mask, uint32_t or_mask)
+{
+	const __m256i a = _mm256_set1_epi32(int(and_mask));
+	const __m256i o = _mm256_set1_epi32(int(or_mask));
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src + i));
+		_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), _mm256_or_si256(_mm256_and_si256(v, a), o));
+	}
+	row32SSE2(dst + i, src + i, n - i, and_mask, or_mask);
+}
+
+__attribute__((target("ssse3"))) void row24SSSE3(uint32_t *dst, uchar const *src, int n)
+{
+	// 16バイト読んで先頭の12バイト(4画素)を使う。読み過ぎないように最後の画素はスカラーで処理する。
+	const __m128i shuffle = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1, 6, 7, 8, -1, 9, 10, 11, -1);
+	const __m128i alpha = _mm_set1_epi32(int(0xff000000u));
+	int i = 0;
+	for (; i + 6 <= n; i += 4) {
+		__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i * 3));
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), _mm_or_si128(_mm_shuffle_epi8(v, shuffle), alpha));
+	}
+	row24Scalar(dst + i, src + i * 3, n - i);
+}
+
+#endif // CLIPBOARDCODEC_X86
+
+struct Kernel {
+	Row32 row32;
+	Row24 row24;
+	char const *name;
+};
+
+// このCPUで使えるカーネルを速い順に並べる
+std::vector<Kernel> availableKernels()
+{
+	std::vector<Kernel> kernels;
+#ifdef CLIPBOARDCODEC_X86
+	__builtin_cpu_init();
+	const bool ssse3 = __builtin_cpu_supports("ssse3");
+	if (__builtin_cpu_supports("avx2")) {
+		if (ssse3) kernels.push_back({row32AVX2, row24SSSE3, "AVX2+SSSE3"});
+		kernels.push_back({row32AVX2, row24Scalar, "AVX2"});
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		if (ssse3) kernels.push_back({row32SSE2, row24SSSE3, "SSE2+SSSE3"});
+		kernels.push_back({row32SSE2, row24Scalar, "SSE2"});
+	}
+#endif
+	kernels.push_back({row32Scalar, row24Scalar, "scalar"});
+	return kernels;
+}
+
+// 起動時に一度だけCPUを判別する
+Kernel kernel = availableKernels().front();
+
+// rowsの行をいくつかに分け、fn(begin, end)をスレッドプールで並列に実行する。
+// 小さな画像は呼び出したスレッドでそのまま処理する。
+template <typename F> void forEachRows(int rows, qint64 bytes, F fn)
+{
+	QThreadPool *pool = QThreadPool::globalInstance();
+	int tasks = 1;
+	if (bytes >= PARALLEL_MIN_BYTES) {
+		tasks = std::clamp(rows / PARALLEL_MIN_ROWS, 1, std::max(pool->maxThreadCount(), 1));
+	}
+	if (tasks == 1) {
+		fn(0, rows);
+		return;
+	}
+	QSemaphore done;
+	for (int t = 1; t < tasks; t++) {
+		const int begin = int(qint64(rows) * t / tasks);
+		const int end = int(qint64(rows) * (t + 1) / tasks);
+		pool->start([&fn, &done, begin, end]() {
+			fn(begin, end);
+			done.release();
+		});
+	}
+	fn(0, int(rows / tasks)); // 最初の範囲は呼び出したスレッドが受け持つ
+	done.acquire(tasks - 1);
+}
+
+} // namespace
+
+const char *ClipboardCodec::kernelName()
+{
+	return kernel.name;
+}
+
+QStringList ClipboardCodec::kernelNames()
+{
+	QStringList names;
+	for (Kernel const &k : availableKernels()) {
+		names.append(k.name);
+	}
+	return names;
+}
+
+bool ClipboardCodec::setKernel(QString const &name)
+{
+	for (Kernel const &k : availableKernels()) {
+		if (name == k.name) {
+			kernel = k;
+			return true;
+		}
+	}
+	return false;
+}
+
+QByteArray ClipboardCodec::imageToDib(const QImage &source)
+{
+	if (source.isNull()) return {};
+	QImage image = source.convertToFormat(QImage::Format_RGB32);
+	const qint64 stride = static_cast<qint64>(image.width()) * 4;
+	const qint64 pixelBytes = stride * image.height();
+	if (pixelBytes <= 0 || pixelBytes > MAX_IMAGE_BYTES - static_cast<qsizetype>(sizeof(BITMAPINFOHEADER)) ||
+		pixelBytes > std::numeric_limits<UINT32>::max()) return {};
+
+	QByteArray dib(sizeof(BITMAPINFOHEADER) + pixelBytes, Qt::Uninitialized);
+	BITMAPINFOHEADER header = {};
+	header.biSize = sizeof(BITMAPINFOHEADER);
+	header.biWidth = image.width();
+	header.biHeight = image.height(); // positive: bottom-up DIB
+	header.biPlanes = 1;
+	header.biBitCount = 32;
+	header.biCompression = BI_RGB;
+	header.biSizeImage = static_cast<DWORD>(pixelBytes);
+	header.biXPelsPerMeter = image.dotsPerMeterX() > 0 ? image.dotsPerMeterX() : DEFAULT_IMAGE_PIXELS_PER_METER;
+	header.biYPelsPerMeter = image.dotsPerMeterY() > 0 ? image.dotsPerMeterY() : DEFAULT_IMAGE_PIXELS_PER_METER;
+	memcpy(dib.data(), &header, sizeof(header));
+
+	// B,G,R,AのAを0にして、行を上下反転して並べる
+	auto *pixels = reinterpret_cast<uchar *>(dib.data() + sizeof(header));
+	const int width = image.width();
+	const int height = image.height();
+	forEachRows(height, pixelBytes, [&](int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			auto const *src = reinterpret_cast<uint32_t const *>(image.constScanLine(height - 1 - y));
+			auto *dst = reinterpret_cast<uint32_t *>(pixels + y * stride);
+			kernel.row32(dst, src, width, 0x00ffffffu, 0);
+		}
+	});
+	return dib;
+}
+
+QImage ClipboardCodec::dibToImage(const QByteArray &dib)
+{
+	if (dib.size() < static_cast<qsizetype>(sizeof(BITMAPINFOHEADER)) ||
+		dib.size() > MAX_IMAGE_BYTES) return {};
+
+	BITMAPINFOHEADER header = {};
+	memcpy(&header, dib.constData(), sizeof(header));
+	if (header.biSize < sizeof(BITMAPINFOHEADER) || header.biSize > static_cast<DWORD>(dib.size()) ||
+		header.biWidth <= 0 || header.biHeight == 0 || header.biHeight == std::numeric_limits<LONG>::min() ||
+		header.biPlanes != 1 || (header.biBitCount != 24 && header.biBitCount != 32) ||
+		header.biCompression != BI_RGB) return {};
+
+	const qint64 width = header.biWidth;
+	const qint64 height = std::abs(static_cast<qint64>(header.biHeight));
+	const qint64 stride = ((width * header.biBitCount + 31) / 32) * 4;
+	const qint64 pixelBytes = stride * height;
+	if (width > std::numeric_limits<int>::max() || height > std::numeric_limits<int>::max() ||
+		pixelBytes <= 0 || pixelBytes > MAX_IMAGE_BYTES ||
+		static_cast<qint64>(header.biSize) + pixelBytes > dib.size()) return {};
+
+	QImage image(static_cast<int>(width), static_cast<int>(height), QImage::Format_RGB32);
+	if (image.isNull()) return {};
+	const auto *pixels = reinterpret_cast<const uchar *>(dib.constData() + header.biSize);
+	const bool bottom_up = header.biHeight > 0;
+	const bool bpp32 = header.biBitCount == 32;
+	const int w = image.width();
+	const int h = image.height();
+	uchar *bits = image.bits(); // 並列に書く前にデタッチしておく
+	const qsizetype bytes_per_line = image.bytesPerLine();
+	forEachRows(h, pixelBytes, [&](int begin, int end) {
+		for (int y = begin; y < end; ++y) {
+			const int srcY = bottom_up ? h - 1 - y : y;
+			const uchar *src = pixels + static_cast<qint64>(srcY) * stride;
+			auto *dst = reinterpret_cast<uint32_t *>(bits + y * bytes_per_line);
+			if (bpp32) {
+				kernel.row32(dst, reinterpret_cast<uint32_t const *>(src), w, 0x00ffffffu, 0xff000000u);
+			} else {
+				kernel.row24(dst, src, w);
+			}
+		}
+	});
+	return image;
+}
+
+QByteArray ClipboardCodec::imageToPng(const QImage &image)
+{
+	if (image.isNull()) return {};
+	if (static_cast<qint64>(image.width()) * image.height() * 4 > MAX_PNG_PIXEL_BYTES) return {};
+
+	QByteArray png;
+	QBuffer buffer(&png);
+	buffer.open(QIODevice::WriteOnly);
+	QImageWriter writer(&buffer, "png");
+	writer.setQuality(PNG_QUALITY);
+	if (!writer.write(image) || png.size() > MAX_IMAGE_BYTES) return {};
+	return png;
+}
+
+QImage ClipboardCodec::pngToImage(const QByteArray &png)
+{
+	if (png.isEmpty() || png.size() > MAX_IMAGE_BYTES) return {};
+
+	QBuffer buffer;
+	buffer.setData(png);
+	buffer.open(QIODevice::ReadOnly);
+	QImageReader reader(&buffer, "png");
+	// 展開する前に、ヘッダの大きさで上限を確かめる
+	const QSize size = reader.size();
+	if (!size.isValid() || static_cast<qint64>(size.width()) * size.height() * 4 > MAX_PNG_PIXEL_BYTES) return {};
+	return reader.read();
+}
@@ -0,0 +1,38 @@
+#ifndef CLIPBOARDCODEC_H
+#define CLIPBOARDCODEC_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QStringList>
+
+// クリップボードの画像とCF_DIB(BITMAPINFOHEADER + 画素)の相互変換。
+// Format_RGB32の画素はメモリ上でB,G,R,Aの順に並ぶので、32bitのDIBとは
+// 4バイト目(アルファ/予約)を書き換えるだけでよい。行の変換には起動時にCPUを判別して
+// AVX2/SSSE3/SSE2/スカラーのいずれかのカーネルを選び、大きな画像は行を分けて並列に処理する。
+namespace ClipboardCodec {
+
+static constexpr qsizetype MAX_IMAGE_BYTES = 64 * 1024 * 1024; // 転送するデータの上限
+static constexpr qsizetype MAX_PNG_PIXEL_BYTES = 256 * 1024 * 1024; // PNGを展開した画素の上限
+static constexpr qint64 PARALLEL_MIN_BYTES = 4 * 1024 * 1024; // これより小さい画像は1スレッドで処理する
+// 登録形式として使うPNGの形式名
+static constexpr char PNG_FORMAT_NAME[] = "PNG";
+
+const char *kernelName();
+// このCPUで使えるカーネルの名前(速い順)
+QStringList kernelNames();
+// 以降の変換で使うカーネルを選ぶ(テストとベンチマーク用)。使えなければfalseを返す。
+// 他のスレッドが変換している間は呼ばない。
+bool setKernel(QString const &name);
+
+// ボトムアップの32bit BI_RGBのDIBを作る。大きすぎる画像なら空を返す。
+QByteArray imageToDib(const QImage &image);
+// 24/32bit BI_RGBのDIB(ボトムアップ/トップダウン)をFormat_RGB32の画像にする。不正なら空を返す。
+QImage dibToImage(const QByteArray &dib);
+// 速さを優先した圧縮レベルでPNGにする。大きすぎる画像なら空を返す。
+QByteArray imageToPng(const QImage &image);
+// PNGを画像にする。不正か、展開すると大きすぎるなら空を返す。
+QImage pngToImage(const QByteArray &png);
+
+} // namespace ClipboardCodec
+
+#endif // CLIPBOARDCODEC_H
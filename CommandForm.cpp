@@ -1,6 +1,5 @@
 #include "CommandForm.h"
 #include "ui_CommandForm.h"
-#include "Global.h"
 #include <QPainter>
 #include "MainWindow.h"
 
@@ -31,16 +30,17 @@ void CommandForm::paintEvent(QPaintEvent *event)
 
 void CommandForm::on_action_disconnect_triggered()
 {
-	if (global->mainwindow) {
-		global->mainwindow->on_action_disconnect_triggered();
+	// 自分を表示しているウィンドウのセッションを操作する
+	if (auto *mainwindow = qobject_cast<MainWindow *>(window())) {
+		mainwindow->on_action_disconnect_triggered();
 	}
 }
 
 
 void CommandForm::on_action_exit_full_screen_triggered()
 {
-	if (global->mainwindow) {
-		global->mainwindow->on_action_exit_full_screen_triggered();
+	if (auto *mainwindow = qobject_cast<MainWindow *>(window())) {
+		mainwindow->on_action_exit_full_screen_triggered();
 	}
 }
 
@@ -7,6 +7,9 @@ ConnectionDialog::ConnectionDialog(QWidget *parent)
 	, ui(new Ui::ConnectionDialog)
 {
 	ui->setupUi(this);
+
+	ui->comboBox_pixel_format->addItem(tr("32-bit (BGRX)"), static_cast<int>(PixelFormat::BGRX32));
+	ui->comboBox_pixel_format->addItem(tr("24-bit (RGB)"), static_cast<int>(PixelFormat::RGB24));
 }
 
 ConnectionDialog::~ConnectionDialog()
@@ -30,6 +33,21 @@ void ConnectionDialog::setCredential(const Credential &cred)
 	}
 }
 
+void ConnectionDialog::setOptions(const ConnectionOptions &options)
+{
+	int i = ui->comboBox_pixel_format->findData(static_cast<int>(options.pixel_format));
+	ui->comboBox_pixel_format->setCurrentIndex(i < 0 ? 0 : i);
+	ui->spinBox_max_fps->setValue(options.max_fps);
+}
+
+ConnectionOptions ConnectionDialog::options() const
+{
+	ConnectionOptions options;
+	options.pixel_format = static_cast<PixelFormat>(ui->comboBox_pixel_format->currentData().toInt());
+	options.max_fps = ui->spinBox_max_fps->value();
+	return options;
+}
+
 QString ConnectionDialog::hostname() const
 {
 	return ui->lineEdit_host->text();
@@ -7,6 +7,18 @@ namespace Ui {
 class ConnectionDialog;
 }
 
+// リモート画面を受け取るGDIバッファの画素形式
+enum class PixelFormat {
+	BGRX32 = 32, // PIXEL_FORMAT_BGRX32 / QImage::Format_RGB32
+	RGB24 = 24,	 // PIXEL_FORMAT_RGB24 / QImage::Format_RGB888
+};
+
+// 接続ごとに選べる設定(資格情報以外)
+struct ConnectionOptions {
+	PixelFormat pixel_format = PixelFormat::BGRX32;
+	int max_fps = 0; // 表示するフレームレートの上限(0: ディスプレイのリフレッシュレート)
+};
+
 class ConnectionDialog : public QDialog {
 	Q_OBJECT
 public:
@@ -20,11 +32,13 @@ public:
 	~ConnectionDialog();
 
 	void setCredential(Credential const &cred);
+	void setOptions(ConnectionOptions const &options);
 
 	QString hostname() const;
 	QString domain() const;
 	QString username() const;
 	QString password() const;
+	ConnectionOptions options() const;
 
 	void accept() override;
 private:
@@ -0,0 +1,138 @@
+#include "FrameRecorder.h"
+#include <cstring>
+
+namespace {
+
+struct RecordHeader {
+	qint64 time;
+	quint16 width;
+	quint16 height;
+	quint16 format;
+	quint16 rect_count;
+};
+
+struct RecordRect {
+	qint32 x;
+	qint32 y;
+	qint32 w;
+	qint32 h;
+};
+
+} // namespace
+
+FrameRecorder::~FrameRecorder()
+{
+	stop();
+}
+
+bool FrameRecorder::start(QString const &path)
+{
+	std::lock_guard lock(mutex);
+	file.close();
+	file.setFileName(path);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return false;
+	file.write(MAGIC, sizeof(MAGIC));
+	start_time = 0;
+	last_size = {};
+	last_format = QImage::Format_Invalid;
+	return true;
+}
+
+void FrameRecorder::stop()
+{
+	std::lock_guard lock(mutex);
+	file.close();
+}
+
+bool FrameRecorder::isRecording()
+{
+	std::lock_guard lock(mutex);
+	return file.isOpen();
+}
+
+void FrameRecorder::write(qint64 time, QImage const &screen, std::vector<QRect> const &rects)
+{
+	std::lock_guard lock(mutex);
+	if (!file.isOpen() || screen.isNull()) return;
+
+	// 最初のレコードと画面サイズが変わったときは、再生側が画面を組み立てられるように全体を書く
+	std::vector<QRect> full;
+	std::vector<QRect> const *list = &rects;
+	if (screen.size() != last_size || screen.format() != last_format) {
+		full.push_back(screen.rect());
+		list = &full;
+		last_size = screen.size();
+		last_format = screen.format();
+	}
+	if (start_time == 0) {
+		start_time = time;
+	}
+
+	RecordHeader header;
+	header.time = time - start_time;
+	header.width = quint16(screen.width());
+	header.height = quint16(screen.height());
+	header.format = quint16(screen.format());
+	header.rect_count = 0;
+	std::vector<RecordRect> clipped;
+	clipped.reserve(list->size());
+	for (QRect r : *list) {
+		r &= screen.rect();
+		if (r.isEmpty()) continue;
+		clipped.push_back({r.x(), r.y(), r.width(), r.height()});
+	}
+	header.rect_count = quint16(clipped.size());
+	file.write(reinterpret_cast<char const *>(&header), sizeof(header));
+	file.write(reinterpret_cast<char const *>(clipped.data()), qint64(clipped.size() * sizeof(RecordRect)));
+
+	const int bpp = screen.depth() / 8;
+	for (RecordRect const &r : clipped) {
+		const qint64 len = qint64(r.w) * bpp;
+		for (int y = r.y; y < r.y + r.h; y++) {
+			file.write(reinterpret_cast<char const *>(screen.constScanLine(y) + r.x * bpp), len);
+		}
+	}
+}
+
+bool FrameReader::open(QString const &path)
+{
+	file.setFileName(path);
+	if (!file.open(QIODevice::ReadOnly)) return false;
+	char magic[sizeof(FrameRecorder::MAGIC)];
+	if (file.read(magic, sizeof(magic)) != sizeof(magic) || memcmp(magic, FrameRecorder::MAGIC, sizeof(magic)) != 0) {
+		file.close();
+		return false;
+	}
+	return true;
+}
+
+bool FrameReader::next()
+{
+	RecordHeader header;
+	if (file.read(reinterpret_cast<char *>(&header), sizeof(header)) != sizeof(header)) return false;
+
+	const QSize size(header.width, header.height);
+	const auto format = QImage::Format(header.format);
+	if (screen_.size() != size || screen_.format() != format) {
+		screen_ = QImage(size, format);
+		if (screen_.isNull()) return false;
+	}
+
+	std::vector<RecordRect> rects(header.rect_count);
+	const qint64 rects_bytes = qint64(rects.size() * sizeof(RecordRect));
+	if (file.read(reinterpret_cast<char *>(rects.data()), rects_bytes) != rects_bytes) return false;
+
+	rects_.clear();
+	const int bpp = screen_.depth() / 8;
+	for (RecordRect const &r : rects) {
+		const QRect rect(r.x, r.y, r.w, r.h);
+		if (!screen_.rect().contains(rect)) return false;
+		const qint64 len = qint64(r.w) * bpp;
+		for (int y = r.y; y < r.y + r.h; y++) {
+			if (file.read(reinterpret_cast<char *>(screen_.scanLine(y) + r.x * bpp), len) != len) return false;
+		}
+		rects_.push_back(rect);
+	}
+	time_ = header.time;
+	return true;
+}
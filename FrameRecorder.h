@@ -0,0 +1,48 @@
+#ifndef FRAMERECORDER_H
+#define FRAMERECORDER_H
+
+#include <QFile>
+#include <QImage>
+#include <QRect>
+#include <mutex>
+#include <vector>
+
+// rdp_end_paintで公開したフレームの差分を、追記のみのファイルへ記録する。
+// 1レコードは 時刻(記録開始からのナノ秒)・画面サイズ・画素形式・矩形の並び・
+// 各矩形の画素 からなり、画素は変化した矩形の分だけを書くので全画面を保存するより小さい。
+// 記録を始めた最初のレコードと、画面サイズが変わった直後のレコードは全画面を含む。
+class FrameRecorder {
+private:
+	std::mutex mutex;
+	QFile file;
+	qint64 start_time = 0;
+	QSize last_size;
+	QImage::Format last_format = QImage::Format_Invalid;
+public:
+	static constexpr char MAGIC[8] = {'R', 'A', 'D', 'I', 'C', 'F', 'R', '1'};
+
+	~FrameRecorder();
+	bool start(const QString &path);
+	void stop();
+	bool isRecording();
+	// RDPスレッドから呼ばれる。記録中でなければ何もしない。
+	void write(qint64 time, const QImage &screen, const std::vector<QRect> &rects);
+};
+
+// FrameRecorderで記録したファイルを先頭から順に読み、画面を再構成する
+class FrameReader {
+private:
+	QFile file;
+	QImage screen_;
+	std::vector<QRect> rects_;
+	qint64 time_ = 0;
+public:
+	bool open(const QString &path);
+	// 次のレコードを読んでscreen()へ反映する。終端か壊れたレコードならfalse。
+	bool next();
+	qint64 time() const { return time_; }
+	const QImage &screen() const { return screen_; }
+	const std::vector<QRect> &rects() const { return rects_; }
+};
+
+#endif // FRAMERECORDER_H
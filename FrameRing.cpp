@@ -0,0 +1,101 @@
+#include "FrameRing.h"
+#include <cstring>
+#include <limits>
+
+static qint64 area(QRect const &r)
+{
+	return qint64(r.width()) * r.height();
+}
+
+QRect DamageRegion::boundingRect() const
+{
+	QRect r;
+	for (int i = 0; i < count_; i++) {
+		r = r.united(rects[i]);
+	}
+	return r;
+}
+
+void DamageRegion::add(QRect const &rect)
+{
+	if (rect.isEmpty()) return;
+
+	// 既存の矩形に含まれていれば何もしない。新しい矩形に含まれる既存の矩形は取り除く。
+	for (int i = 0; i < count_;) {
+		if (rects[i].contains(rect)) return;
+		if (rect.contains(rects[i])) {
+			rects[i] = rects[--count_];
+			continue;
+		}
+		i++;
+	}
+	if (count_ < MAX_RECTS) {
+		rects[count_++] = rect;
+		return;
+	}
+
+	// 満杯のときは、統合しても面積の増加が最も少ない矩形へまとめる
+	int best = 0;
+	qint64 best_cost = std::numeric_limits<qint64>::max();
+	for (int i = 0; i < count_; i++) {
+		qint64 cost = area(rects[i].united(rect)) - area(rects[i]);
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = i;
+		}
+	}
+	rects[best] = rects[best].united(rect);
+}
+
+void DamageRegion::add(DamageRegion const &other)
+{
+	for (QRect const &r : other) {
+		add(r);
+	}
+}
+
+size_t FrameRing::write(QImage const &screen, DamageRegion const &damage)
+{
+	Frame &f = frames[back];
+	if (f.image.size() != screen.size() || f.image.format() != screen.format()) {
+		// サイズが変わったときだけ確保し直す。他の2枚は、backに回ってきた時点で同様に確保し直される。
+		f.image = QImage(screen.size(), screen.format());
+		f.pending.clear();
+		f.pending.add(screen.rect());
+	} else {
+		f.pending.add(damage);
+	}
+	for (int i = 0; i < 3; i++) {
+		if (i != back) {
+			frames[i].pending.add(damage);
+		}
+	}
+
+	// このバッファが前回公開されてから後の差分を、まとめてGDIのバッファからコピーする
+	size_t bytes = 0;
+	const int bpp = screen.depth() / 8;
+	const qsizetype src_stride = screen.bytesPerLine();
+	const qsizetype dst_stride = f.image.bytesPerLine();
+	const uchar *src = screen.constBits();
+	uchar *dst = f.image.bits();
+	for (QRect r : f.pending) {
+		r &= screen.rect();
+		if (r.isEmpty()) continue;
+		const size_t len = size_t(r.width()) * bpp;
+		for (int y = r.top(); y <= r.bottom(); y++) {
+			memcpy(dst + y * dst_stride + r.x() * bpp, src + y * src_stride + r.x() * bpp, len);
+		}
+		bytes += len * r.height();
+	}
+	f.pending.clear();
+
+	back = ready.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+	return bytes;
+}
+
+bool FrameRing::acquire()
+{
+	if (!(ready.load(std::memory_order_relaxed) & FRESH)) return false;
+	front = ready.exchange(front, std::memory_order_acq_rel) & INDEX_MASK;
+	return true;
+}
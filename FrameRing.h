@@ -0,0 +1,71 @@
+#ifndef FRAMERING_H
+#define FRAMERING_H
+
+#include <QImage>
+#include <QRect>
+#include <atomic>
+
+// 固定長の矩形リストで表した差分領域。
+// 容量を超えたら面積の増加が最も少ない既存の矩形へ統合するので、
+// 矩形を追加してもヒープ確保は発生しない。
+class DamageRegion {
+public:
+	static constexpr int MAX_RECTS = 32;
+private:
+	QRect rects[MAX_RECTS];
+	int count_ = 0;
+public:
+	void clear()
+	{
+		count_ = 0;
+	}
+	bool isEmpty() const
+	{
+		return count_ == 0;
+	}
+	int count() const
+	{
+		return count_;
+	}
+	QRect const *begin() const
+	{
+		return rects;
+	}
+	QRect const *end() const
+	{
+		return rects + count_;
+	}
+	QRect boundingRect() const;
+	void add(QRect const &rect);
+	void add(DamageRegion const &other);
+};
+
+// RDPスレッド(書き込み側)とGUIスレッド(読み出し側)の間でフレームを受け渡す
+// 三面バッファ。3枚のバッファは使い回し、インデックスの交換だけをアトミックに行う。
+// 書き込み側はback、読み出し側はfrontだけに触れるので、互いにロックは不要。
+class FrameRing {
+private:
+	struct Frame {
+		QImage image;
+		DamageRegion pending; // このバッファにまだ反映されていない差分(書き込み側専用)
+	};
+	static constexpr int INDEX_MASK = 3;
+	static constexpr int FRESH = 4; // readyに未読のフレームが入っている
+
+	Frame frames[3];
+	int back = 0;			  // 書き込み側専用
+	int front = 1;			  // 読み出し側専用
+	std::atomic<int> ready { 2 }; // 受け渡し用のインデックス | FRESH
+public:
+	// 書き込み側: screenのdamage部分をbackへコピーして公開する。コピーしたバイト数を返す。
+	size_t write(QImage const &screen, DamageRegion const &damage);
+
+	// 読み出し側: 新しいフレームが公開されていればfrontと交換する。
+	bool acquire();
+	QImage const &frontImage() const
+	{
+		return frames[front].image;
+	}
+};
+
+#endif // FRAMERING_H
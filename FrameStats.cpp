@@ -0,0 +1,142 @@
+#include "FrameStats.h"
+#include <QFile>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <algorithm>
+#include <chrono>
+
+int LatencyHistogram::bucketOf(qint64 usecs)
+{
+	if (usecs < SUB_BUCKETS) return usecs < 0 ? 0 : int(usecs);
+	// 最上位ビットの位置eと、その下の3ビットでバケットを決める
+	int e = 63 - __builtin_clzll(quint64(usecs));
+	int sub = int(usecs >> (e - 3)) - SUB_BUCKETS;
+	int bucket = SUB_BUCKETS + (e - 3) * SUB_BUCKETS + sub;
+	return bucket < BUCKETS ? bucket : BUCKETS - 1;
+}
+
+qint64 LatencyHistogram::upperBoundOf(int bucket)
+{
+	if (bucket < SUB_BUCKETS) return bucket;
+	int e = (bucket - SUB_BUCKETS) / SUB_BUCKETS + 3;
+	int sub = (bucket - SUB_BUCKETS) % SUB_BUCKETS;
+	return (qint64(SUB_BUCKETS + sub + 1) << (e - 3)) - 1;
+}
+
+void LatencyHistogram::record(qint64 nsecs)
+{
+	counts[bucketOf(nsecs / 1000)].fetch_add(1, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::reset()
+{
+	for (auto &c : counts) {
+		c.store(0, std::memory_order_relaxed);
+	}
+}
+
+quint64 LatencyHistogram::count() const
+{
+	quint64 n = 0;
+	for (auto const &c : counts) {
+		n += c.load(std::memory_order_relaxed);
+	}
+	return n;
+}
+
+qint64 LatencyHistogram::percentile(double p) const
+{
+	quint32 snapshot[BUCKETS];
+	quint64 total = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		snapshot[i] = counts[i].load(std::memory_order_relaxed);
+		total += snapshot[i];
+	}
+	if (total == 0) return 0;
+	const quint64 rank = std::max<quint64>(1, quint64(p * total + 0.5));
+	quint64 n = 0;
+	for (int i = 0; i < BUCKETS; i++) {
+		n += snapshot[i];
+		if (n >= rank) return upperBoundOf(i);
+	}
+	return upperBoundOf(BUCKETS - 1);
+}
+
+QJsonObject LatencyHistogram::toJson() const
+{
+	QJsonArray buckets;
+	for (int i = 0; i < BUCKETS; i++) {
+		const quint32 n = counts[i].load(std::memory_order_relaxed);
+		if (n == 0) continue;
+		QJsonObject b;
+		b["le_us"] = upperBoundOf(i);
+		b["count"] = qint64(n);
+		buckets.append(b);
+	}
+	QJsonObject obj;
+	obj["count"] = qint64(count());
+	obj["p50_us"] = percentile(0.50);
+	obj["p95_us"] = percentile(0.95);
+	obj["p99_us"] = percentile(0.99);
+	obj["buckets"] = buckets;
+	return obj;
+}
+
+char const *FrameStats::stageName(Stage stage)
+{
+	switch (stage) {
+	case Copy: return "copy";
+	case Compose: return "compose";
+	case Paint: return "paint";
+	case Flush: return "flush";
+	case Total: return "total";
+	default: return "";
+	}
+}
+
+qint64 FrameStats::now()
+{
+	using namespace std::chrono;
+	return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count();
+}
+
+void FrameStats::reset()
+{
+	for (auto &h : stages) {
+		h.reset();
+	}
+	reconnect.reset();
+}
+
+bool FrameStats::save(QString const &json_path, QString const &csv_path) const
+{
+	QJsonArray array;
+	QString csv = "stage,count,p50_us,p95_us,p99_us\n";
+	for (int i = 0; i <= StageCount; i++) {
+		// 最後の行は自動再接続にかかった時間
+		auto const &h = i < StageCount ? stages[i] : reconnect;
+		const char *name = i < StageCount ? stageName(Stage(i)) : "reconnect";
+		const quint64 count = h.count();
+		const qint64 p50 = h.percentile(0.50);
+		const qint64 p95 = h.percentile(0.95);
+		const qint64 p99 = h.percentile(0.99);
+		QJsonObject obj;
+		obj["stage"] = name;
+		obj["count"] = qint64(count);
+		obj["p50_us"] = p50;
+		obj["p95_us"] = p95;
+		obj["p99_us"] = p99;
+		array.append(obj);
+		csv += QString("%1,%2,%3,%4,%5\n").arg(name).arg(count).arg(p50).arg(p95).arg(p99);
+	}
+
+	QFile json(json_path);
+	if (!json.open(QIODevice::WriteOnly | QIODevice::Truncate)) return false;
+	json.write(QJsonDocument(array).toJson());
+
+	QFile file(csv_path);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return false;
+	file.write(csv.toUtf8());
+	return true;
+}
@@ -0,0 +1,54 @@
+#ifndef FRAMESTATS_H
+#define FRAMESTATS_H
+
+#include <QString>
+#include <atomic>
+
+class QJsonObject;
+
+// ロックなしで記録できる固定長のヒストグラム。
+// 値はマイクロ秒単位で、2の冪ごとに8分割した対数線形のバケットに数える。
+class LatencyHistogram {
+public:
+	static constexpr int SUB_BUCKETS = 8;
+	static constexpr int BUCKETS = 256;
+private:
+	std::atomic<quint32> counts[BUCKETS] = {};
+	static int bucketOf(qint64 usecs);
+	static qint64 upperBoundOf(int bucket);
+public:
+	void record(qint64 nsecs);
+	void reset();
+	quint64 count() const;
+	// p(0〜1)に相当する値をマイクロ秒で返す(バケットの上限値)
+	qint64 percentile(double p) const;
+	// 件数・パーセンタイルと、空でないバケットの上限値(マイクロ秒)ごとの件数
+	QJsonObject toJson() const;
+};
+
+// 1フレームが画面に出るまでの各段階の所要時間
+class FrameStats {
+public:
+	enum Stage {
+		Copy,	 // EndPaint → 差分のコピー完了
+		Compose, // コピー完了 → ワーカーがGUIへ通知
+		Paint,	 // 通知 → paintEventでの描画完了(表示間隔の待ちを含む)
+		Flush,	 // 描画完了 → バッキングストアのフラッシュ完了
+		Total,	 // EndPaint → フラッシュ完了
+		StageCount,
+	};
+	static char const *stageName(Stage stage);
+	static qint64 now(); // 全スレッド共通の単調増加時刻(ナノ秒)
+
+	LatencyHistogram stages[StageCount];
+	LatencyHistogram reconnect; // ネットワークが切れてから自動再接続できるまでの時間
+
+	void record(Stage stage, qint64 nsecs)
+	{
+		stages[stage].record(nsecs);
+	}
+	void reset();
+	bool save(QString const &json_path, QString const &csv_path) const;
+};
+
+#endif // FRAMESTATS_H
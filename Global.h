@@ -6,8 +6,6 @@
 #define ORGANIZATION_NAME "soramimi.jp"
 #define APPLICATION_NAME "Radic"
 
-class MainWindow;
-
 class ApplicationBasicData {
 public:
 	QString organization_name = ORGANIZATION_NAME;
@@ -19,8 +17,6 @@ public:
 };
 
 class ApplicationGlobal : public ApplicationBasicData {
-public:
-	MainWindow *mainwindow = nullptr;
 };
 
 extern ApplicationGlobal *global;
@@ -0,0 +1,173 @@
+#include "ImageScaler.h"
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define IMAGESCALER_X86 1
+#include <immintrin.h>
+#endif
+
+namespace {
+
+using ExpandRow32 = void (*)(uint32_t *dst, uint32_t const *src, int n, int factor);
+
+void expandRow32Scalar(uint32_t *dst, uint32_t const *src, int n, int factor)
+{
+	for (int i = 0; i < n; i++) {
+		const uint32_t v = src[i];
+		for (int k = 0; k < factor; k++) {
+			*dst++ = v;
+		}
+	}
+}
+
+void expandRowScalar(uchar *dst, uchar const *src, int n, int factor, int bpp)
+{
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < factor; k++) {
+			memcpy(dst, src, bpp);
+			dst += bpp;
+		}
+		src += bpp;
+	}
+}
+
+#ifdef IMAGESCALER_X86
+
+__attribute__((target("sse2"))) void expandRow32SSE2(uint32_t *dst, uint32_t const *src, int n, int factor)
+{
+	int i = 0;
+	switch (factor) {
+	case 2:
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 0), _mm_unpacklo_epi32(v, v));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4), _mm_unpackhi_epi32(v, v));
+			dst += 8;
+		}
+		break;
+	case 3:
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 0), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 0, 0)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 1, 1)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 2)));
+			dst += 12;
+		}
+		break;
+	case 4:
+		for (; i + 4 <= n; i += 4) {
+			__m128i v = _mm_loadu_si128(reinterpret_cast<__m128i const *>(src + i));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 0), _mm_shuffle_epi32(v, _MM_SHUFFLE(0, 0, 0, 0)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 4), _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 1, 1, 1)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 8), _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 2, 2, 2)));
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dst + 12), _mm_shuffle_epi32(v, _MM_SHUFFLE(3, 3, 3, 3)));
+			dst += 16;
+		}
+		break;
+	}
+	expandRow32Scalar(dst, src + i, n - i, factor);
+}
+
+__attribute__((target("avx2"))) void expandRow32AVX2(uint32_t *dst, uint32_t const *src, int n, int factor)
+{
+	if (factor < 2 || factor > 4) {
+		expandRow32Scalar(dst, src, n, factor);
+		return;
+	}
+	// 出力のk番目のベクタのj番目の要素は、入力の(8k+j)/factor番目の画素
+	__m256i index[4];
+	for (int k = 0; k < factor; k++) {
+		const int base = 8 * k;
+		index[k] = _mm256_setr_epi32((base + 0) / factor, (base + 1) / factor, (base + 2) / factor, (base + 3) / factor,
+									 (base + 4) / factor, (base + 5) / factor, (base + 6) / factor, (base + 7) / factor);
+	}
+	int i = 0;
+	for (; i + 8 <= n; i += 8) {
+		__m256i v = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(src + i));
+		for (int k = 0; k < factor; k++) {
+			_mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + 8 * k), _mm256_permutevar8x32_epi32(v, index[k]));
+		}
+		dst += 8 * factor;
+	}
+	expandRow32SSE2(dst, src + i, n - i, factor);
+}
+
+#endif // IMAGESCALER_X86
+
+struct Kernel {
+	ExpandRow32 expand_row_32;
+	char const *name;
+};
+
+// このCPUで使えるカーネルを速い順に並べる
+std::vector<Kernel> availableKernels()
+{
+	std::vector<Kernel> kernels;
+#ifdef IMAGESCALER_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) kernels.push_back({expandRow32AVX2, "AVX2"});
+	if (__builtin_cpu_supports("sse2")) kernels.push_back({expandRow32SSE2, "SSE2"});
+#endif
+	kernels.push_back({expandRow32Scalar, "scalar"});
+	return kernels;
+}
+
+// 起動時に一度だけCPUを判別する
+Kernel kernel = availableKernels().front();
+
+} // namespace
+
+const char *ImageScaler::kernelName()
+{
+	return kernel.name;
+}
+
+QStringList ImageScaler::kernelNames()
+{
+	QStringList names;
+	for (Kernel const &k : availableKernels()) {
+		names.append(k.name);
+	}
+	return names;
+}
+
+bool ImageScaler::setKernel(QString const &name)
+{
+	for (Kernel const &k : availableKernels()) {
+		if (name == k.name) {
+			kernel = k;
+			return true;
+		}
+	}
+	return false;
+}
+
+void ImageScaler::expandRow32(uint32_t *dst, uint32_t const *src, int n, int factor)
+{
+	kernel.expand_row_32(dst, src, n, factor);
+}
+
+void ImageScaler::scale(QImage *dst, QImage const &src, QRect const &rect, int factor)
+{
+	const QRect r = rect & src.rect();
+	if (r.isEmpty() || factor < 1) return;
+	if (dst->size() != src.size() * factor || dst->format() != src.format()) return;
+
+	const int bpp = src.depth() / 8;
+	const size_t row_bytes = size_t(r.width()) * factor * bpp;
+	for (int y = r.top(); y <= r.bottom(); y++) {
+		uchar const *s = src.constScanLine(y) + r.x() * bpp;
+		uchar *d = dst->scanLine(y * factor) + r.x() * factor * bpp;
+		if (bpp == 4) {
+			kernel.expand_row_32(reinterpret_cast<uint32_t *>(d), reinterpret_cast<uint32_t const *>(s), r.width(), factor);
+		} else {
+			expandRowScalar(d, s, r.width(), factor, bpp);
+		}
+		// 縦方向は拡大済みの行を複製する
+		for (int k = 1; k < factor; k++) {
+			memcpy(dst->scanLine(y * factor + k) + r.x() * factor * bpp, d, row_bytes);
+		}
+	}
+}
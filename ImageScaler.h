@@ -0,0 +1,30 @@
+#ifndef IMAGESCALER_H
+#define IMAGESCALER_H
+
+#include <QImage>
+#include <QRect>
+#include <QStringList>
+#include <cstdint>
+
+// 最近傍法による整数倍の拡大。
+// 32bit画素の行の拡大には、起動時にCPUを判別してAVX2/SSE2/スカラーのいずれかの
+// カーネルを選ぶ。24bitなどそれ以外の画素形式はスカラー版で処理する。
+namespace ImageScaler {
+
+const char *kernelName();
+// このCPUで使えるカーネルの名前(速い順)
+QStringList kernelNames();
+// 以降の拡大で使うカーネルを選ぶ(テストとベンチマーク用)。使えなければfalseを返す。
+// 他のスレッドが拡大している間は呼ばない。
+bool setKernel(QString const &name);
+
+// 32bit画素のn個をそれぞれfactor個に並べてdstへ書き込む(scaleの横方向の処理)
+void expandRow32(uint32_t *dst, uint32_t const *src, int n, int factor);
+
+// srcのrectの範囲をfactor倍して、dstの対応する位置(rectの座標もfactor倍)へ書き込む。
+// dstはsrcのfactor倍の大きさで、同じ画素形式でなければならない。
+void scale(QImage *dst, QImage const &src, QRect const &rect, int factor);
+
+} // namespace ImageScaler
+
+#endif // IMAGESCALER_H
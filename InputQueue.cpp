@@ -0,0 +1,70 @@
+#include "InputQueue.h"
+#include "FrameStats.h"
+#include <winpr/input.h>
+
+bool InputQueue::push(InputEvent const &event)
+{
+	const size_t t = tail.load(std::memory_order_relaxed);
+	if (t - head.load(std::memory_order_acquire) >= CAPACITY) return false;
+	events[t % CAPACITY] = event;
+	tail.store(t + 1, std::memory_order_release);
+	return true;
+}
+
+void InputQueue::clear()
+{
+	head.store(tail.load(std::memory_order_acquire), std::memory_order_release);
+	last_chunk_time = 0;
+}
+
+int InputQueue::drain(rdpInput *input)
+{
+	// FreeRDPの公開APIでは1回の呼び出しが1つのファストパスPDUになり、複数のイベントを
+	// 1つのPDUへまとめて送る手段がないので、イベントは1つずつ送る。間引くのはマウスの移動だけで、
+	// 直後に移動かボタンのイベントが続くときに限る。区切り(Chunk)の間隔は従来どおり守る。
+	size_t h = head.load(std::memory_order_relaxed);
+	const size_t t = tail.load(std::memory_order_acquire);
+	int sent = 0;
+	int wait = -1;
+	for (; h != t; h++) {
+		InputEvent const &e = events[h % CAPACITY];
+		switch (e.type) {
+		case InputEvent::Chunk: {
+			const qint64 now = FrameStats::now();
+			const qint64 elapsed_ms = (now - last_chunk_time) / 1000000;
+			if (last_chunk_time != 0 && elapsed_ms < CHUNK_INTERVAL_MS) {
+				wait = int(CHUNK_INTERVAL_MS - elapsed_ms);
+				break;
+			}
+			last_chunk_time = now;
+			break;
+		}
+		case InputEvent::Key: {
+			// キーの解放は、こちらが押下を送っていなくても必ず送る。修飾キーを戻す処理
+			// (sendKeyboardModifiers)は、サーバー側に残った押下を解除するために送っている。
+			const DWORD code = GetVirtualScanCodeFromVirtualKeyCode(e.vk, WINPR_KBD_TYPE_IBM_ENHANCED);
+			freerdp_input_send_keyboard_event_ex(input, e.pressed, e.autorepeat, code);
+			sent++;
+			break;
+		}
+		case InputEvent::Mouse:
+			if (e.flags == PTR_FLAGS_MOVE && h + 1 != t) {
+				// 移動とボタンのイベントは位置を含むので、直後にあればそれがポインタを動かす。
+				// ホイールの位置はサーバーが使わない(FreeRDPのクライアントは0,0で送る)ので、
+				// ホイールの前の移動は落とさない。
+				InputEvent const &next = events[(h + 1) % CAPACITY];
+				if (next.type == InputEvent::Mouse && !(next.flags & (PTR_FLAGS_WHEEL | PTR_FLAGS_HWHEEL))) {
+					coalesced_moves.fetch_add(1, std::memory_order_relaxed);
+					break;
+				}
+			}
+			freerdp_input_send_mouse_event(input, e.flags, e.x, e.y);
+			sent++;
+			break;
+		}
+		if (wait >= 0) break; // この区切りから先は次回に送る
+	}
+	head.store(h, std::memory_order_release);
+	sent_pdus.fetch_add(sent, std::memory_order_relaxed);
+	return wait;
+}
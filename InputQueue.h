@@ -0,0 +1,52 @@
+#ifndef INPUTQUEUE_H
+#define INPUTQUEUE_H
+
+#include <QtGlobal>
+#include <atomic>
+#include <cstddef>
+#include <freerdp/input.h>
+
+// GUIスレッドで発生した入力を、RDPスレッドがまとめて送るための入力イベント
+struct InputEvent {
+	enum Type : quint8 {
+		Chunk, // 区切り: 前の区切りから少なくともCHUNK_INTERVAL_MS空けてから続きを送る
+		Key,
+		Mouse,
+	};
+	Type type = Chunk;
+	bool pressed = false;	 // Key
+	bool autorepeat = false; // Key
+	UINT16 flags = 0;		 // Mouse: PTR_FLAGS_*
+	UINT16 x = 0;			 // Mouse
+	UINT16 y = 0;			 // Mouse
+	DWORD vk = 0;			 // Key: 仮想キーコード
+};
+
+// 書き込み側(GUIスレッド)と読み出し側(RDPスレッド)が1つずつの、固定長のロックなしキュー。
+// 書き込み側はtail、読み出し側はheadだけを進める。
+class InputQueue {
+public:
+	static constexpr size_t CAPACITY = 1024;
+	static constexpr int CHUNK_INTERVAL_MS = 1;
+private:
+	InputEvent events[CAPACITY];
+	alignas(64) std::atomic<size_t> head { 0 }; // 読み出し側が進める
+	alignas(64) std::atomic<size_t> tail { 0 }; // 書き込み側が進める
+	qint64 last_chunk_time = 0; // 読み出し側専用
+public:
+	std::atomic<int> coalesced_moves { 0 }; // drainで間引いたマウス移動の数
+	std::atomic<int> sent_pdus { 0 }; // drainで送った入力PDU(イベント1つにつき1つ)の数
+
+	// 書き込み側: 満杯なら捨ててfalseを返す
+	bool push(InputEvent const &event);
+	// 読み出し側: 溜まっている入力を送らずに捨てる
+	void clear();
+
+	// 読み出し側: 溜まっている入力をinputへ送る。
+	// 直後に移動かボタンのイベント(位置を含む)が続く移動は送らない。
+	// 区切りの間隔を待つために途中で止めたときは、次に呼ぶまでの時間(ミリ秒)を返す。
+	// すべて送ったときは-1を返す。
+	int drain(rdpInput *input);
+};
+
+#endif // INPUTQUEUE_H
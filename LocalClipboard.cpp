@@ -0,0 +1,152 @@
+#include "LocalClipboard.h"
+#include "ClipboardCodec.h"
+#include <QApplication>
+#include <QClipboard>
+#include <QMimeData>
+#include <QtEndian>
+#include <atomic>
+
+LocalClipboardSnapshot::LocalClipboardSnapshot(quint64 generation, QString text, bool local_image, RemoteClipboardOffer relay)
+	: generation(generation)
+	, text(std::move(text))
+	, local_image(local_image)
+	, relay(std::move(relay))
+{
+}
+
+QByteArray LocalClipboardSnapshot::unicodeText() const
+{
+	if (!hasText()) return {};
+	if (relay.clipboard) {
+		return relay.clipboard->fetch(relay.generation, CF_UNICODETEXT);
+	}
+	QByteArray encoded((text.size() + 1) * 2, Qt::Uninitialized);
+	auto *dst = reinterpret_cast<uchar *>(encoded.data());
+	for (qsizetype i = 0; i < text.size(); ++i) {
+		qToLittleEndian<quint16>(text.utf16()[i], dst + i * 2);
+	}
+	qToLittleEndian<quint16>(0, dst + text.size() * 2);
+	return encoded;
+}
+
+QByteArray LocalClipboardSnapshot::encodeDib() const
+{
+	if (!relay.clipboard) return ClipboardCodec::imageToDib(image);
+	if (relay.has_dib) return relay.clipboard->fetch(relay.generation, CF_DIB);
+	return ClipboardCodec::imageToDib(ClipboardCodec::pngToImage(relay.clipboard->fetch(relay.generation, relay.png_format)));
+}
+
+QByteArray LocalClipboardSnapshot::encodePng() const
+{
+	if (!relay.clipboard) return ClipboardCodec::imageToPng(image);
+	if (relay.png_format) return relay.clipboard->fetch(relay.generation, relay.png_format);
+	return ClipboardCodec::imageToPng(ClipboardCodec::dibToImage(relay.clipboard->fetch(relay.generation, CF_DIB)));
+}
+
+QByteArray LocalClipboardSnapshot::dib() const
+{
+	if (!hasImage()) return {};
+	// 取れなかったときは、次に要求されたときにもう一度作る
+	std::lock_guard lock(cache_mutex);
+	if (dib_cache.isEmpty()) {
+		dib_cache = encodeDib();
+	}
+	return dib_cache;
+}
+
+QByteArray LocalClipboardSnapshot::png() const
+{
+	if (!hasImage()) return {};
+	std::lock_guard lock(cache_mutex);
+	if (png_cache.isEmpty()) {
+		png_cache = encodePng();
+	}
+	return png_cache;
+}
+
+QByteArray LocalClipboardSnapshot::data(LocalClipboardFormat format) const
+{
+	switch (format) {
+	case LocalClipboardFormat::UnicodeText: return unicodeText();
+	case LocalClipboardFormat::Dib: return dib();
+	case LocalClipboardFormat::Png: return png();
+	}
+	return {};
+}
+
+bool LocalClipboardSnapshot::needsImage() const
+{
+	if (relay.clipboard || !local_image) return false;
+	std::lock_guard lock(cache_mutex);
+	return image.isNull();
+}
+
+void LocalClipboardSnapshot::setImage(QImage image) const
+{
+	std::lock_guard lock(cache_mutex);
+	this->image = std::move(image);
+}
+
+LocalClipboard::LocalClipboard()
+{
+	encoder.setMaxThreadCount(1);
+	connect(QApplication::clipboard(), &QClipboard::dataChanged, this, [this]() {
+		dirty = true;
+		emit changed();
+	});
+}
+
+LocalClipboard *LocalClipboard::instance()
+{
+	static LocalClipboard *clipboard = new LocalClipboard;
+	return clipboard;
+}
+
+std::shared_ptr<const LocalClipboardSnapshot> LocalClipboard::capture()
+{
+	if (dirty) {
+		dirty = false;
+		// 同じプロセスのセッションがサーバーから受け取った内容は、中身を取り出さずに中継する
+		const QMimeData *mime = QApplication::clipboard()->mimeData();
+		auto const *remote = qobject_cast<RemoteMimeData const *>(mime);
+		QString text;
+		bool image = false;
+		RemoteClipboardOffer relay;
+		if (remote) {
+			relay = remote->source();
+		} else if (mime && !mime->hasFormat(REMOTE_CLIPBOARD_MIME)) {
+			// 出どころの分からないリモートの内容は、どのセッションへも送らない。
+			// 画像はデコードに時間がかかるので、サーバーが要求するまで取り出さない。
+			image = mime->hasImage();
+			if (mime->hasText()) text = mime->text();
+		}
+		auto snapshot = std::make_shared<const LocalClipboardSnapshot>(++generation, std::move(text), image, std::move(relay));
+		std::atomic_store_explicit(&current, snapshot, std::memory_order_release);
+	}
+	return snapshot();
+}
+
+std::shared_ptr<const LocalClipboardSnapshot> LocalClipboard::snapshot() const
+{
+	return std::atomic_load_explicit(&current, std::memory_order_acquire);
+}
+
+void LocalClipboard::encode(std::shared_ptr<const LocalClipboardSnapshot> snapshot, LocalClipboardFormat format, std::function<void(QByteArray)> done)
+{
+	auto encode = [this, snapshot, format, done = std::move(done)]() {
+		encoder.start([snapshot, format, done]() {
+			done(snapshot->data(format));
+		});
+	};
+	if (format == LocalClipboardFormat::UnicodeText || !snapshot->needsImage()) {
+		encode();
+		return;
+	}
+	QMetaObject::invokeMethod(this, [this, snapshot, encode = std::move(encode)]() {
+		// 提示した後にクリップボードが変わっていたら、その画像はもうないので空のまま答える
+		if (!dirty && this->snapshot() == snapshot) {
+			snapshot->setImage(QApplication::clipboard()->image());
+		}
+		encode();
+	}, Qt::QueuedConnection);
+}
@@ -0,0 +1,87 @@
+#ifndef LOCALCLIPBOARD_H
+#define LOCALCLIPBOARD_H
+
+#include "RemoteClipboard.h"
+#include <QByteArray>
+#include <QImage>
+#include <QObject>
+#include <QString>
+#include <QThreadPool>
+#include <functional>
+#include <memory>
+#include <mutex>
+
+// セッションのサーバーへ渡すクリップボードの形式
+enum class LocalClipboardFormat {
+	UnicodeText, // CF_UNICODETEXT
+	Dib,		 // CF_DIB
+	Png,		 // 登録形式のPNG
+};
+
+// ある時点のローカルのクリップボードの中身。公開した後は変更しない。
+// 画像は有無だけを持ち、最初に要求されたときにGUIスレッドで取り出して、DIBとPNGを作って保持する。
+// 同じプロセスの別のセッションがサーバーから受け取った内容なら、中身は持たずに
+// 要求されたときにそのセッションのサーバーから取り寄せる(relay)。
+class LocalClipboardSnapshot {
+private:
+	mutable std::mutex cache_mutex;
+	mutable QImage image; // 取り出したローカルの画像
+	mutable QByteArray dib_cache;
+	mutable QByteArray png_cache;
+	QByteArray encodeDib() const;
+	QByteArray encodePng() const;
+public:
+	const quint64 generation;
+	const QString text;
+	const bool local_image; // ローカルのクリップボードに画像がある
+	const RemoteClipboardOffer relay;
+
+	LocalClipboardSnapshot(quint64 generation, QString text, bool local_image, RemoteClipboardOffer relay = {});
+	bool hasText() const { return relay.clipboard ? relay.has_text : !text.isEmpty(); }
+	bool hasImage() const { return relay.clipboard ? (relay.has_dib || relay.png_format != 0) : local_image; }
+	// 別のセッションのサーバーから取り寄せる内容か
+	bool isRelay() const { return bool(relay.clipboard); }
+	// このセッションのサーバーから来た内容か(送り返さない)
+	bool isFrom(RemoteClipboard const *clipboard) const { return relay.clipboard && relay.clipboard.get() == clipboard; }
+	// 以下はどのスレッドから呼んでもよい。取れなければ空を返す。
+	// CF_UNICODETEXT(NUL終端のUTF-16LE)
+	QByteArray unicodeText() const;
+	// CF_DIB。ローカルの画像は、setImageで渡された後でなければ空を返す。
+	QByteArray dib() const;
+	// 登録形式のPNG
+	QByteArray png() const;
+	// formatの中身(上のいずれか)
+	QByteArray data(LocalClipboardFormat format) const;
+	// ローカルの画像をまだ取り出していない
+	bool needsImage() const;
+	// GUIスレッドで取り出したローカルの画像を渡す
+	void setImage(QImage image) const;
+};
+
+// プロセスに1つの、ローカルのクリップボードとセッションの間の受け渡し口。
+// クリップボードが変わるとchangedを送り、形式はいずれかのセッションが必要としたときに
+// 一度だけGUIスレッドで調べて、スナップショットとして丸ごと差し替える。
+// cliprdrチャネルのスレッドはsnapshotでその時点のものを受け取り、GUIスレッドを待たない。
+class LocalClipboard : public QObject {
+	Q_OBJECT
+private:
+	std::shared_ptr<const LocalClipboardSnapshot> current;
+	quint64 generation = 0; // GUIスレッド専用
+	bool dirty = true; // GUIスレッド専用: 変わってからまだ取り出していない
+	QThreadPool encoder; // 画像の変換と中継の取り寄せを1つずつ行う
+	LocalClipboard();
+public:
+	// GUIスレッドで最初に呼ぶ
+	static LocalClipboard *instance();
+	// GUIスレッドから呼ぶ。変わっていれば取り出して公開し、現在のスナップショットを返す。
+	std::shared_ptr<const LocalClipboardSnapshot> capture();
+	std::shared_ptr<const LocalClipboardSnapshot> snapshot() const;
+	// どのスレッドから呼んでもよい。snapshotのformatの中身を変換用のスレッドで作り、doneへ渡す(取れなければ空)。
+	// 中継の取り寄せも変換用のスレッドで行い、ローカルの画像はGUIスレッドへ取り出しを頼むだけなので、
+	// 呼んだスレッドは待たない。
+	void encode(std::shared_ptr<const LocalClipboardSnapshot> snapshot, LocalClipboardFormat format, std::function<void(QByteArray)> done);
+signals:
+	void changed();
+};
+
+#endif // LOCALCLIPBOARD_H
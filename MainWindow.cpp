@@ -1,30 +1,73 @@
 #include "MainWindow.h"
 #include "ui_MainWindow.h"
+#include "ClipboardCodec.h"
 #include "ConnectionDialog.h"
+#include "LocalClipboard.h"
+#include "RemoteClipboard.h"
 #include "MySettings.h"
+#include "NetworkProfile.h"
+#include "SessionStats.h"
+#include <QActionGroup>
 #include <QPainter>
 #include <QWindow>
 #include <QApplication>
 #include <QClipboard>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QJsonDocument>
+#include <QLabel>
 #include <QMetaObject>
 #include <QMimeData>
+#include <QPushButton>
+#include <QSignalBlocker>
 #include <QThread>
-#include <QtEndian>
+#include <algorithm>
 #include <atomic>
+#include <condition_variable>
+#include <freerdp/codec/color.h>
 #include <limits>
+#include <mutex>
+#include <optional>
 #include <thread>
 #include "Global.h"
 #include "VerifyCertificateDialog.h"
+#include "FrameRecorder.h"
+#include "FrameRing.h"
+#include "FrameStats.h"
 #include "rdpcert.h"
+#include "joinpath.h"
 
 #define RDP_SESSION RdpSessionV2
 
+// ネットワークが切れたときの自動再接続の間隔(倍々に延ばす)と回数
+static constexpr int RECONNECT_INITIAL_DELAY_MS = 250;
+static constexpr int RECONNECT_MAX_DELAY_MS = 8000;
+static constexpr int RECONNECT_MAX_ATTEMPTS = 10;
+
+// セッションの統計をログへ書く間隔の既定値(秒)
+static constexpr int STATS_LOG_INTERVAL_SEC = 10;
+
+// こちらからPNGを提示するときの登録形式のID(0xC000〜0xFFFFの範囲で、クライアントが決めてよい)
+static constexpr UINT32 CLIENT_PNG_FORMAT_ID = 0xC0A0;
+
 struct MyClientContext {
 	rdpClientContext rdpcc;
 	MainWindow *self = nullptr;
 	DispClientContext *disp = nullptr;
+	// 統計を取るために差し替えたFreeRDPの関数の元のもの
+	decltype(freerdp::SendChannelData) send_channel_data = nullptr;
+	decltype(freerdp::ReceiveChannelData) receive_channel_data = nullptr;
+	decltype(RdpgfxClientContext::SurfaceCommand) gfx_surface_command = nullptr;
 };
 
+// FreeRDPのコールバックは、コンテキストに記録したウィンドウへ振り分ける。
+// V1・V2ともにコンテキストはsizeof(MyClientContext)で確保している。
+static MainWindow *windowOf(rdpContext *context)
+{
+	return context ? reinterpret_cast<MyClientContext *>(context)->self : nullptr;
+}
+
 class RdpSession {
 public:
 	virtual RdpSessionVersion version() = 0;
@@ -59,7 +102,10 @@ public:
 	void context_new(MainWindow *self)
 	{
 		d.rdp = freerdp_new();
+		// コールバックから自分のウィンドウを引けるように、V2と同じ大きさで確保させる
+		d.rdp->ContextSize = sizeof(MyClientContext);
 		freerdp_context_new(d.rdp);
+		reinterpret_cast<MyClientContext *>(d.rdp->context)->self = self;
 	}
 
 	void context_free()
@@ -136,22 +182,53 @@ public:
 
 struct MainWindow::Private {
 	std::shared_ptr<RdpSession> session;
-	QTimer update_timer;
-	bool connected = false;
+	QTimer resize_timer; // 動的解像度の変更をまとめるための遅延
 	QSize size { 1920, 1080 };
 	std::thread rdp_thread;
-	bool interrupted = false;
-	int dynamic_resize_counter = 0;
+	// 接続の状態と切断の要求はGUIスレッドとRDPスレッドの両方から読み書きする
+	std::atomic<ConnectionState> state { ConnectionState::Disconnected };
+	std::atomic<bool> interrupted { false };
+	// 接続のたびに進める。RDPスレッドから遅れて届いた通知が前の接続のものかどうかを見分ける。
+	quint64 session_id = 0;
+	std::atomic<int> reconnect_attempt { 0 }; // 自動再接続の何回目か
+	QString hostname; // 接続先(GUIスレッド専用)
+	QPushButton *cancel_button = nullptr; // 接続中だけ状態バーに出す
+	// RDPスレッドがGUIスレッドでの処理(証明書の確認)の結果を待つためのもの
+	std::mutex gui_call_mutex;
+	std::condition_variable gui_call_cv;
+
+	// RDPスレッドはネットワークのイベントとこのイベントを無期限に待つ。
+	// 切断や解像度変更の要求など、RDPスレッドに処理させたいことがあるときにシグナルする。
+	HANDLE wakeup_event = nullptr;
+	std::mutex request_mutex;
+	QSize requested_size; // RDPスレッドで適用する解像度(空なら要求なし)
+
+	QLabel *input_latency_label = nullptr; // 状態バーに出す入力遅延
+	QLabel *network_label = nullptr; // 状態バーに出す回線の計測と選んだプロファイル
+
+	// サーバーの自動検出で計測した回線の状態と、それから選んだコーデックと圧縮。
+	// 接続中はRDPスレッドが書き、接続の前後はGUIスレッドが読み書きする。
+	// network_profileだけは接続中もGUIスレッドが統計のログに書くために読む。
+	NetworkMeasurement network;
+	std::atomic<NetworkProfile> network_profile { NetworkProfile::Lan };
+
+	// セッションの統計。RDPスレッドとチャネルのスレッドが数え、GUIスレッドが1秒ごとに読み出して
+	// オーバーレイと状態バーに出し、stats_log_intervalごとにJSONの1行としてログへ書く。
+	SessionStats stats;
+	SessionStats::Cursor stats_view_cursor;
+	SessionStats::Cursor stats_log_cursor;
+	QTimer stats_timer;
+	QLabel *stats_label = nullptr;
+	QFile stats_log; // 接続ごとに最初に書くときに開く
+	int stats_log_interval = STATS_LOG_INTERVAL_SEC; // 0: 書かない
+	int stats_log_elapsed = 0;
 
 	Qt::KeyboardModifiers last_keyboard_modifier = (Qt::KeyboardModifier)-1;
 
-#if 1
-	constexpr static UINT32 rdp_pixel_format = PIXEL_FORMAT_RGB24;
-	constexpr static QImage::Format screen_image_foramt = QImage::Format_RGB888;
-#else
-	constexpr static UINT32 rdp_pixel_format = PIXEL_FORMAT_RGBX32;
-	constexpr static QImage::Format screen_image_foramt = QImage::Format_RGBX8888;
-#endif
+	// GDIの画素形式は接続ごとに選べる。既定のBGRX32はQtのバックングストアと同じ
+	// Format_RGB32なので、描画時に画素の並べ替えが発生しない。
+	UINT32 rdp_pixel_format = PIXEL_FORMAT_BGRX32;
+	QImage::Format screen_image_foramt = QImage::Format_RGB32;
 
 	QImage screen_image;
 
@@ -162,93 +239,19 @@ struct MainWindow::Private {
 	// スロットリングと同じ狙い)。screen_imageはGDIが継続的に書き込む
 	// ライブバッファなので、スキップしても最新の累積状態は失われない。
 	std::atomic<bool> v2_paint_pending { false };
+	// スキップしている間の差分はpending_damageへ和として溜め、次に渡せるときにまとめて渡す。
+	// 以下の3つはRDPスレッド専用(damage_waitingだけはGUIスレッドも読む)。
+	DamageRegion pending_damage;
+	qint64 pending_damage_time = 0; // pending_damageのうち最も古いEndPaintの時刻
+	std::atomic<bool> damage_waiting { false }; // 表示待ちのために渡せていない差分がある
+	std::vector<QRect> damage_rects; // flushDamageで毎回使い回す
+	FrameRecorder frame_recorder; // View > Record Framesで有効にする
 
 	CliprdrClientContext *cliprdr = nullptr;
-	bool updating_remote_clipboard = false;
-	std::atomic<UINT32> requested_clipboard_format { 0 };
-	std::atomic<quint64> remote_clipboard_generation { 0 };
-	int remote_clipboard_request_attempts = 0;
-	QString local_clipboard_text;
-	QImage local_clipboard_image;
-	bool local_clipboard_has_text = false;
-	bool local_clipboard_has_image = false;
+	// サーバーのクリップボードは、ローカルで貼り付けられたときに初めて取りに行く
+	std::shared_ptr<RemoteClipboard> remote_clipboard = std::make_shared<RemoteClipboard>();
 };
 
-static constexpr char REMOTE_CLIPBOARD_MIME[] = "application/x-radic-remote-clipboard";
-static constexpr qsizetype MAX_CLIPBOARD_IMAGE_BYTES = 64 * 1024 * 1024;
-static constexpr LONG DEFAULT_IMAGE_PIXELS_PER_METER = 3780; // 96 DPI
-
-static QByteArray imageToDib(const QImage &source)
-{
-	if (source.isNull()) return {};
-	QImage image = source.convertToFormat(QImage::Format_RGB32);
-	const qint64 stride = static_cast<qint64>(image.width()) * 4;
-	const qint64 pixelBytes = stride * image.height();
-	if (pixelBytes <= 0 || pixelBytes > MAX_CLIPBOARD_IMAGE_BYTES - static_cast<qsizetype>(sizeof(BITMAPINFOHEADER)) ||
-		pixelBytes > std::numeric_limits<UINT32>::max()) return {};
-
-	QByteArray dib(sizeof(BITMAPINFOHEADER) + pixelBytes, Qt::Uninitialized);
-	BITMAPINFOHEADER header = {};
-	header.biSize = sizeof(BITMAPINFOHEADER);
-	header.biWidth = image.width();
-	header.biHeight = image.height(); // positive: bottom-up DIB
-	header.biPlanes = 1;
-	header.biBitCount = 32;
-	header.biCompression = BI_RGB;
-	header.biSizeImage = static_cast<DWORD>(pixelBytes);
-	header.biXPelsPerMeter = image.dotsPerMeterX() > 0 ? image.dotsPerMeterX() : DEFAULT_IMAGE_PIXELS_PER_METER;
-	header.biYPelsPerMeter = image.dotsPerMeterY() > 0 ? image.dotsPerMeterY() : DEFAULT_IMAGE_PIXELS_PER_METER;
-	memcpy(dib.data(), &header, sizeof(header));
-
-	auto *dst = reinterpret_cast<uchar *>(dib.data() + sizeof(header));
-	for (int y = 0; y < image.height(); ++y) {
-		const QRgb *src = reinterpret_cast<const QRgb *>(image.constScanLine(image.height() - 1 - y));
-		for (int x = 0; x < image.width(); ++x) {
-			dst[x * 4 + 0] = qBlue(src[x]);
-			dst[x * 4 + 1] = qGreen(src[x]);
-			dst[x * 4 + 2] = qRed(src[x]);
-			dst[x * 4 + 3] = 0;
-		}
-		dst += stride;
-	}
-	return dib;
-}
-
-static QImage dibToImage(const QByteArray &dib)
-{
-	if (dib.size() < static_cast<qsizetype>(sizeof(BITMAPINFOHEADER)) ||
-		dib.size() > MAX_CLIPBOARD_IMAGE_BYTES) return {};
-
-	BITMAPINFOHEADER header = {};
-	memcpy(&header, dib.constData(), sizeof(header));
-	if (header.biSize < sizeof(BITMAPINFOHEADER) || header.biSize > static_cast<DWORD>(dib.size()) ||
-		header.biWidth <= 0 || header.biHeight == 0 || header.biHeight == std::numeric_limits<LONG>::min() ||
-		header.biPlanes != 1 || (header.biBitCount != 24 && header.biBitCount != 32) ||
-		header.biCompression != BI_RGB) return {};
-
-	const qint64 width = header.biWidth;
-	const qint64 height = std::abs(static_cast<qint64>(header.biHeight));
-	const qint64 stride = ((width * header.biBitCount + 31) / 32) * 4;
-	const qint64 pixelBytes = stride * height;
-	if (width > std::numeric_limits<int>::max() || height > std::numeric_limits<int>::max() ||
-		pixelBytes <= 0 || pixelBytes > MAX_CLIPBOARD_IMAGE_BYTES ||
-		static_cast<qint64>(header.biSize) + pixelBytes > dib.size()) return {};
-
-	QImage image(static_cast<int>(width), static_cast<int>(height), QImage::Format_RGB32);
-	if (image.isNull()) return {};
-	const auto *pixels = reinterpret_cast<const uchar *>(dib.constData() + header.biSize);
-	for (int y = 0; y < image.height(); ++y) {
-		const int srcY = header.biHeight > 0 ? image.height() - 1 - y : y;
-		const uchar *src = pixels + static_cast<qint64>(srcY) * stride;
-		QRgb *dst = reinterpret_cast<QRgb *>(image.scanLine(y));
-		for (int x = 0; x < image.width(); ++x) {
-			const int offset = x * (header.biBitCount / 8);
-			dst[x] = qRgb(src[offset + 2], src[offset + 1], src[offset]);
-		}
-	}
-	return image;
-}
-
 void MainWindow::setupRdpContext(rdpContext *rdpcx)
 {
 	rdpcx->update->EndPaint = MainWindow::rdp_end_paint;
@@ -256,6 +259,28 @@ void MainWindow::setupRdpContext(rdpContext *rdpcx)
 	// rdpcx->update->PlaySound = MainWindow::rdp_play_sound;
 }
 
+// FreeRDPが確保するポインタ。FreeRDPのポインタキャッシュ(キャッシュインデックスごと)に
+// 保持され、形状が届いたときに一度だけNewが呼ばれる。領域はFreeRDPがゼロで確保するので
+// C++のオブジェクトは直接持たない。
+struct RadicPointer {
+	rdpPointer pointer;
+	quint64 id;
+};
+
+// GUIスレッドでポインタのカーソルを扱えるように、RDPスレッドから登録する
+void MainWindow::registerPointer(rdpContext *rdpcx)
+{
+	rdpPointer pointer = {};
+	pointer.size = sizeof(RadicPointer);
+	pointer.New = MainWindow::rdp_pointer_new;
+	pointer.Free = MainWindow::rdp_pointer_free;
+	pointer.Set = MainWindow::rdp_pointer_set;
+	pointer.SetNull = MainWindow::rdp_pointer_set_null;
+	pointer.SetDefault = MainWindow::rdp_pointer_set_default;
+	pointer.SetPosition = MainWindow::rdp_pointer_set_position;
+	graphics_register_pointer(rdpcx->graphics, &pointer);
+}
+
 MainWindow::MainWindow(QWidget *parent)
 	: QMainWindow(parent)
 	, ui(new Ui::MainWindow)
@@ -274,27 +299,61 @@ MainWindow::MainWindow(QWidget *parent)
 
 	setDefaultWindowTitle();
 
+	{
+		auto *group = new QActionGroup(this);
+		const std::pair<QAction *, int> scales[] = {
+			{ui->action_view_scale_1x, 1},
+			{ui->action_view_scale_2x, 2},
+			{ui->action_view_scale_3x, 3},
+			{ui->action_view_scale_4x, 4},
+		};
+		for (auto [action, scale] : scales) {
+			group->addAction(action);
+			connect(action, &QAction::triggered, this, [this, scale = scale]() { setViewScale(scale); });
+		}
+	}
+
 	qApp->installEventFilter(this);
 
 	connect(this, &MainWindow::emitConnect, this, &MainWindow::on_action_connect_triggered);
 	connect(this, &MainWindow::emitDisconnect, this, &MainWindow::on_action_disconnect_triggered);
 
-	connect(&m->update_timer, &QTimer::timeout, this, &MainWindow::onIntervalTimer);
-	m->update_timer.setInterval(10);
-	m->update_timer.start();
+	m->wakeup_event = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+
+	connect(&m->resize_timer, &QTimer::timeout, this, &MainWindow::onIntervalTimer);
+	m->resize_timer.setSingleShot(true);
+	m->resize_timer.setInterval(500);
 
 	connect(this, &MainWindow::requestUpdateScreen, this, &MainWindow::updateScreen);
 
-	// MyView側が1フレームの処理を終えたら、V2のペイント待機フラグを解除する
-	connect(ui->widget_view, &MyView::ready, this, [this]() {
+	// MyView側が1フレームを表示したら、V2のペイント待機フラグを解除する。
+	// 表示の間隔はMyViewが制御しているので、見られることのないフレームはコピーされない。
+	connect(ui->widget_view, &MyView::presented, this, [this]() {
 		m->v2_paint_pending = false;
+		if (m->damage_waiting) {
+			// スキップした差分が溜まっているので、次のEndPaintを待たずにRDPスレッドに渡させる
+			wakeupRdpThread();
+		}
 	});
-	connect(QApplication::clipboard(), &QClipboard::dataChanged, this, [this]() {
-		if (m->updating_remote_clipboard) return;
-		const QMimeData *mime = QApplication::clipboard()->mimeData();
-		if (mime && mime->hasFormat(REMOTE_CLIPBOARD_MIME)) return;
-		sendClipboardFormatList();
+	// 入力はMyViewのキューへ積まれるので、RDPスレッドを起こして送らせる
+	connect(ui->widget_view, &MyView::inputAvailable, this, &MainWindow::wakeupRdpThread);
+
+	m->input_latency_label = new QLabel(this);
+	statusBar()->addPermanentWidget(m->input_latency_label);
+	m->network_label = new QLabel(this);
+	statusBar()->addPermanentWidget(m->network_label);
+	m->stats_label = new QLabel(this);
+	statusBar()->addPermanentWidget(m->stats_label);
+	connect(&m->stats_timer, &QTimer::timeout, this, &MainWindow::updateSessionStats);
+	m->cancel_button = new QPushButton(tr("Cancel"), this);
+	m->cancel_button->setVisible(false);
+	statusBar()->addPermanentWidget(m->cancel_button);
+	connect(m->cancel_button, &QPushButton::clicked, this, &MainWindow::doDisconnect);
+	ui->action_disconnect->setEnabled(false);
+	connect(ui->widget_view, &MyView::inputLatencyChanged, this, [this](qint64 p50, qint64 p95) {
+		m->input_latency_label->setText(tr("Input latency p50 %1 ms / p95 %2 ms").arg(p50 / 1000.0, 0, 'f', 1).arg(p95 / 1000.0, 0, 'f', 1));
 	});
+	connect(LocalClipboard::instance(), &LocalClipboard::changed, this, &MainWindow::sendClipboardFormatList);
 
 	{
 		Qt::WindowStates state = windowState();
@@ -304,6 +363,15 @@ MainWindow::MainWindow(QWidget *parent)
 		bool maximized = settings.value("Maximized").toBool();
 		restoreGeometry(settings.value("Geometry").toByteArray());
 		settings.endGroup();
+
+		// 入力遅延の計測で、ポインタの周りのこの範囲(RDPの画素数、0なら画面全体)の変化を応答とみなす
+		settings.beginGroup("Latency");
+		ui->widget_view->setInputLatencyProbeRadius(settings.value("ProbeRadius", 64).toInt());
+		settings.endGroup();
+		// 接続中の統計をJSONで書き出す間隔(秒、0なら書かない)
+		settings.beginGroup("Statistics");
+		m->stats_log_interval = settings.value("LogInterval", STATS_LOG_INTERVAL_SEC).toInt();
+		settings.endGroup();
 		if (maximized) {
 			state |= Qt::WindowMaximized;
 			setWindowState(state);
@@ -317,7 +385,10 @@ MainWindow::MainWindow(QWidget *parent)
 
 MainWindow::~MainWindow()
 {
-	doDisconnect();
+	waitForDisconnect();
+	if (m->wakeup_event) {
+		CloseHandle(m->wakeup_event);
+	}
 	delete m;
 	delete ui;
 }
@@ -390,8 +461,8 @@ BOOL MainWindow::clientContextNew(freerdp *instance, rdpContext *context)
 	if (!instance || !context)
 		return false;
 
-	MyClientContext *ctx = reinterpret_cast<MyClientContext *>(context);
-	ctx->self->initInstance(instance);
+	// selfはまだ設定されていない
+	initInstance(instance);
 	return true;
 }
 
@@ -412,18 +483,38 @@ int MainWindow::clientContextStop(rdpContext *context)
 	return 0;
 }
 
-void MainWindow::doConnect(const QString &hostname, const QString &username, const QString &password, const QString &domain)
+void MainWindow::setPixelFormat(PixelFormat format)
 {
-	if (m->connected) {
-		doDisconnect();
+	switch (format) {
+	case PixelFormat::RGB24:
+		m->rdp_pixel_format = PIXEL_FORMAT_RGB24;
+		m->screen_image_foramt = QImage::Format_RGB888;
+		break;
+	case PixelFormat::BGRX32:
+	default:
+		m->rdp_pixel_format = PIXEL_FORMAT_BGRX32;
+		m->screen_image_foramt = QImage::Format_RGB32;
+		break;
 	}
+}
+
+void MainWindow::doConnect(const QString &hostname, const QString &username, const QString &password, const QString &domain, const ConnectionOptions &options)
+{
+	// 前の接続が残っていれば、切断が終わるのを待ってから始める
+	if (m->rdp_thread.joinable()) {
+		waitForDisconnect();
+	}
+
+	setPixelFormat(options.pixel_format);
+	ui->widget_view->setMaxFps(options.max_fps);
 
 	m->screen_image = {};
 	m->v2_paint_pending = false;
+	m->pending_damage.clear();
+	m->pending_damage_time = 0;
+	m->damage_waiting = false;
 	m->cliprdr = nullptr;
-	m->requested_clipboard_format = 0;
-	m->remote_clipboard_generation++;
-	m->remote_clipboard_request_attempts = 0;
+	m->remote_clipboard->setChannel(nullptr);
 
 	// 動的解像度が有効な場合は、現在のビューサイズに合わせる
 	if (isDynamicResizingEnabled()) {
@@ -459,17 +550,41 @@ void MainWindow::doConnect(const QString &hostname, const QString &username, con
 	freerdp_settings_set_bool(settings, FreeRDP_FrameMarkerCommandEnabled, TRUE);
 	freerdp_settings_set_bool(settings, FreeRDP_SupportDynamicChannels, TRUE);
 	freerdp_settings_set_bool(settings, FreeRDP_RedirectClipboard, TRUE);
+	// サーバーから自動再接続のクッキーを受け取り、ネットワークが切れたときに使う
+	freerdp_settings_set_bool(settings, FreeRDP_AutoReconnectionEnabled, TRUE);
+	freerdp_settings_set_uint32(settings, FreeRDP_AutoReconnectMaxRetries, RECONNECT_MAX_ATTEMPTS);
 	freerdp_settings_set_uint32(settings, FreeRDP_ClipboardFeatureMask, CLIPRDR_FLAG_LOCAL_TO_REMOTE | CLIPRDR_FLAG_REMOTE_TO_LOCAL);
 
+	// 回線の状態をサーバーに計測させ(接続時と接続中)、その結果でコーデックと圧縮を選ぶ
+	freerdp_settings_set_uint32(settings, FreeRDP_ConnectionType, CONNECTION_TYPE_AUTODETECT);
+	freerdp_settings_set_bool(settings, FreeRDP_NetworkAutoDetect, TRUE);
+	rdp_instance()->context->autodetect->NetworkCharacteristicsResult = rdp_network_characteristics_result;
+	{
+		// チャネルごとの通信量を数えるため、チャネルのデータの送受信を中継する
+		freerdp *instance = rdp_instance();
+		MyClientContext *cc = reinterpret_cast<MyClientContext *>(instance->context);
+		cc->send_channel_data = instance->SendChannelData;
+		cc->receive_channel_data = instance->ReceiveChannelData;
+		if (cc->send_channel_data) instance->SendChannelData = rdp_send_channel_data;
+		if (cc->receive_channel_data) instance->ReceiveChannelData = rdp_receive_channel_data;
+	}
+	// 同じ接続先へつなぎ直すときは前回の計測から選ぶ。初めての接続先はLANとして始め、
+	// 接続時の自動検出の結果でコーデックを選び直す。
+	if (hostname != m->hostname) {
+		m->network = {};
+	}
+	m->network_profile = NetworkProfiles::select(m->network);
 	// V1はGraphics Pipeline(rdpgfx)チャンネルを実装していないため、有効化するとサーバー側の
 	// チャンネルハンドシェイクがタイムアウトするまで通常の描画オーダーへフォールバックされず、
 	// 初回描画が遅延する。V1では明示的に無効化する。
-	freerdp_settings_set_bool(settings, FreeRDP_SupportGraphicsPipeline, rdp_session_version() == RdpSessionVersion::V2);
-	freerdp_settings_set_bool(settings, FreeRDP_GfxAVC444, true);
-	freerdp_settings_set_bool(settings, FreeRDP_GfxAVC444v2, true);
-	freerdp_settings_set_bool(settings, FreeRDP_GfxH264, true);
-	freerdp_settings_set_bool(settings, FreeRDP_RemoteFxCodec, false);
-	freerdp_settings_set_uint32(settings, FreeRDP_ColorDepth, 32);
+	NetworkProfiles::applyCodec(settings, m->network_profile, rdp_session_version() == RdpSessionVersion::V2);
+	NetworkProfiles::applyCompression(settings, m->network);
+	showNetworkStatus(m->network, m->network_profile, m->network_profile);
+
+	m->stats_log.close();
+	m->stats_log_elapsed = 0;
+	m->stats_view_cursor = m->stats_log_cursor = m->stats.reset();
+	m->stats_timer.start(1000);
 
 #if 0 // RdpSessionVersion::V1 では、クリップボードの正常な動作が確認できなかったため一旦無効化しておく
 	// freerdp_client_context_new()を使うV2はクライアントエントリポイントが
@@ -482,41 +597,67 @@ void MainWindow::doConnect(const QString &hostname, const QString &username, con
 	}
 #endif
 
-	// 接続実行
-	if (freerdp_connect(rdp_instance())) {
-		m->connected = true;
-		m->update_timer.start();
-		ui->widget_view->setRdpInstance(rdp_instance());
-
-		start_rdp_thread();
-
-		statusBar()->showMessage("Connected to " + hostname);
-
-		QString title = hostname + " - Radic";
-		setWindowTitle(title);
-	} else {
-		QMessageBox::critical(this, "Error", "Failed to connect to " + hostname);
-		m->session->context_free();
-	}
+	// 接続(名前解決からアクティブになるまで)はRDPスレッドで行い、GUIスレッドを止めない
+	m->hostname = hostname;
+	m->session_id++;
+	setConnectionState(ConnectionState::Resolving);
+	start_rdp_thread(m->session_id, hostname);
 }
 
+// 切断を要求する。接続の途中なら中断させる。
+// 切断そのものはRDPスレッドで行い、終わるとGUIスレッドでfinishDisconnectが呼ばれる。
 void MainWindow::doDisconnect()
 {
 	ui->widget_view->setRdpInstance(nullptr);
-	m->update_timer.stop();
+	m->resize_timer.stop();
+	if (!m->rdp_thread.joinable()) return;
 
-	m->interrupted = true;
-	if (m->rdp_thread.joinable()) {
-		m->rdp_thread.join();
+	{
+		// 証明書の確認などでGUIスレッドの応答を待っていれば、待つのをやめさせる
+		std::lock_guard lock(m->gui_call_mutex);
+		m->interrupted = true;
 	}
+	m->gui_call_cv.notify_all();
+	setConnectionState(ConnectionState::Closing);
+	// freerdp_connectの中で名前解決や応答を待っていれば、すぐに戻らせる
+	freerdp_abort_connect_context(m->session->rdp_context());
+	wakeupRdpThread();
+}
+
+// 切断を要求し、終わるまで待つ。終了時など、後がないときにだけ使う。
+void MainWindow::waitForDisconnect()
+{
+	doDisconnect();
+	finishDisconnect(m->session_id);
+}
 
+// RDPスレッドが切断を終えた後の片付け
+void MainWindow::finishDisconnect(quint64 session_id)
+{
+	// 前の接続から遅れて届いた通知や、すでに片付けた後なら何もしない
+	if (session_id != m->session_id || !m->rdp_thread.joinable()) return;
+	m->rdp_thread.join();
+
+	ui->widget_view->setRdpInstance(nullptr);
+	m->resize_timer.stop();
 	if (rdp_instance()) {
-		freerdp_disconnect(rdp_instance());
 		m->session->context_free();
 	}
-	m->connected = false;
+	setConnectionState(ConnectionState::Disconnected);
 	statusBar()->showMessage("Disconnected");
 
+	QString latency_path = ui->widget_view->saveInputLatency(global->app_config_dir);
+	if (!latency_path.isEmpty()) {
+		statusBar()->showMessage(tr("Disconnected (input latency saved to %1)").arg(latency_path));
+	}
+	m->input_latency_label->clear();
+	m->network_label->clear();
+	m->stats_timer.stop();
+	writeSessionStatsLog(); // 最後の区間
+	m->stats_log.close();
+	m->stats_label->clear();
+	ui->widget_view->setSessionStatistics({});
+
 	QImage image(m->size.width(), m->size.height(), m->screen_image_foramt);
 	image.fill(Qt::black);
 	m->screen_image = image;
@@ -528,24 +669,111 @@ void MainWindow::doDisconnect()
 	setDefaultWindowTitle();
 }
 
+// どのスレッドから呼んでもよい
+void MainWindow::setConnectionState(ConnectionState state)
+{
+	// 切断が要求された後は、接続の段階を進めない
+	if (m->interrupted && state != ConnectionState::Closing && state != ConnectionState::Disconnected) return;
+	// 再接続の間は、FreeRDPから届く接続の途中の段階を表に出さない
+	if (m->state == ConnectionState::Reconnecting && state > ConnectionState::Disconnected && state < ConnectionState::Active) return;
+	m->state = state;
+	QMetaObject::invokeMethod(this, [this]() { showConnectionState(); }, Qt::QueuedConnection);
+}
+
+// 状態バーと操作の可否を、その時点の状態に合わせる
+void MainWindow::showConnectionState()
+{
+	const ConnectionState state = m->state;
+	QString text;
+	switch (state) {
+	case ConnectionState::Resolving:
+		text = tr("Connecting to %1: resolving host...").arg(m->hostname);
+		break;
+	case ConnectionState::Tls:
+		text = tr("Connecting to %1: securing connection...").arg(m->hostname);
+		break;
+	case ConnectionState::Auth:
+		text = tr("Connecting to %1: authenticating...").arg(m->hostname);
+		break;
+	case ConnectionState::Capabilities:
+		text = tr("Connecting to %1: negotiating capabilities...").arg(m->hostname);
+		break;
+	case ConnectionState::Reconnecting:
+		text = tr("Connection to %1 lost, reconnecting (attempt %2 of %3)...").arg(m->hostname).arg(m->reconnect_attempt.load()).arg(RECONNECT_MAX_ATTEMPTS);
+		break;
+	case ConnectionState::Closing:
+		text = tr("Disconnecting from %1...").arg(m->hostname);
+		break;
+	default:
+		// 接続と切断の完了は、それぞれの処理が状態バーに出す
+		break;
+	}
+	if (!text.isEmpty()) {
+		statusBar()->showMessage(text);
+	}
+	const bool connecting = state != ConnectionState::Disconnected && state != ConnectionState::Active && state != ConnectionState::Closing;
+	m->cancel_button->setVisible(connecting);
+	// 再接続している間は、最後のフレームを暗くして残しておく
+	ui->widget_view->setDimmed(state == ConnectionState::Reconnecting);
+	ui->action_disconnect->setEnabled(state != ConnectionState::Disconnected && state != ConnectionState::Closing);
+}
+
+bool MainWindow::isConnected() const
+{
+	return m->state == ConnectionState::Active;
+}
+
+// RDPスレッドから呼ぶ: fnをGUIスレッドで実行して結果を待つ。
+// 始まる前に切断が要求されたら、実行も待つこともやめてfallbackを返す。
+// 始まった後は、fnがこのスレッドの引数を参照していることがあるので終わるまで待つ。
+DWORD MainWindow::callOnGuiThread(std::function<DWORD()> const &fn, DWORD fallback)
+{
+	if (QThread::currentThread() == thread()) return fn();
+
+	struct Call {
+		bool started = false;
+		bool done = false;
+		DWORD result = 0;
+	};
+	auto call = std::make_shared<Call>();
+	const quint64 session_id = m->session_id; // 接続中は変わらない
+	QMetaObject::invokeMethod(this, [this, call, fn, fallback, session_id]() {
+		{
+			std::lock_guard lock(m->gui_call_mutex);
+			if (m->interrupted || session_id != m->session_id) return; // RDPスレッドはもう待っていない
+			call->started = true;
+		}
+		const DWORD result = fn();
+		std::lock_guard lock(m->gui_call_mutex);
+		call->done = true;
+		call->result = result;
+		m->gui_call_cv.notify_all();
+	}, Qt::QueuedConnection);
+
+	std::unique_lock lock(m->gui_call_mutex);
+	m->gui_call_cv.wait(lock, [&]() { return call->done || (m->interrupted && !call->started); });
+	return call->done ? call->result : fallback;
+}
+
 void MainWindow::onIntervalTimer()
 {
 	if (m->interrupted) return;
-	if (!m->connected) return;
+	if (!isConnected()) return;
 
-	if (m->dynamic_resize_counter > 0) {
-		m->dynamic_resize_counter--;
-		if (m->dynamic_resize_counter == 0) {
-			resizeDynamic();
-			return;
-		}
+	resizeDynamic();
+}
+
+void MainWindow::wakeupRdpThread()
+{
+	if (m->wakeup_event) {
+		SetEvent(m->wakeup_event);
 	}
 }
 
 void MainWindow::updateScreen()
 {
 	if (m->interrupted) return;
-	if (!m->connected) return;
+	if (!isConnected()) return;
 
 	QImage image;
 	std::swap(image, m->screen_image);
@@ -556,18 +784,30 @@ void MainWindow::updateScreen()
 	}
 }
 
-void MainWindow::updateScreen2(QImage const &image, QRect const &rect)
+void MainWindow::updateScreen2(QImage const &image, std::vector<QRect> const &rects, qint64 end_paint_time)
 {
 	if (m->interrupted) return;
-	if (!m->connected) return;
+	if (!isConnected()) return;
 
 	if (!image.isNull()) {
 		if (rdp_session_version() == RdpSessionVersion::V2) {
-			ui->widget_view->setImage(image, rect);
+			ui->widget_view->setDamage(image, rects, end_paint_time);
 		}
 	}
 }
 
+void MainWindow::setViewScale(int scale)
+{
+	ui->widget_view->setScale(scale);
+	ui->action_view_scale_1x->setChecked(scale == 1);
+	ui->action_view_scale_2x->setChecked(scale == 2);
+	ui->action_view_scale_3x->setChecked(scale == 3);
+	ui->action_view_scale_4x->setChecked(scale == 4);
+	if (isDynamicResizingEnabled()) {
+		resizeDynamicLater();
+	}
+}
+
 void MainWindow::showCommandForm(bool show)
 {
 	if (isFullScreen()) {
@@ -638,14 +878,7 @@ bool MainWindow::eventFilter(QObject *watched, QEvent *event)
 			} else if (pressed && key == Qt::Key_D) {
 				if (isSpecialModifiersPressed) {
 					ui->widget_view->sendKeyboardModifiers(Qt::NoModifier);
-					if (ui->widget_view->scale() == 1) {
-						ui->widget_view->setScale(2);
-					} else {
-						ui->widget_view->setScale(1);
-					}
-					if (isDynamicResizingEnabled()) {
-						resizeDynamicLater();
-					}
+					setViewScale(ui->widget_view->scale() == 1 ? 2 : 1);
 					return true;
 				}
 			} else if (pressed && key == Qt::Key_F4) {
@@ -732,6 +965,15 @@ void MainWindow::resizeEvent(QResizeEvent *event)
 	resizeDynamicLater();
 }
 
+// 同じプロセスで別のセッションを開く。セッションはウィンドウごとに独立していて、
+// クリップボードだけをLocalClipboardを通して共有する。
+void MainWindow::on_action_new_window_triggered()
+{
+	auto *w = new MainWindow;
+	w->setAttribute(Qt::WA_DeleteOnClose);
+	w->show();
+}
+
 void MainWindow::on_action_connect_triggered()
 {
 	MySettings settings;
@@ -743,17 +985,25 @@ void MainWindow::on_action_connect_triggered()
 	cred.password = {};
 	cred.domain = settings.value("Domain", "WORKGROUP").toString();
 
+	ConnectionOptions options;
+	options.pixel_format = static_cast<PixelFormat>(settings.value("PixelFormat", static_cast<int>(options.pixel_format)).toInt());
+	options.max_fps = settings.value("MaxFps", options.max_fps).toInt();
+
 	ConnectionDialog dlg;
 	dlg.setCredential(cred);
+	dlg.setOptions(options);
 	if (dlg.exec() == QDialog::Accepted) {
 		QString hostname = dlg.hostname();
 		QString username = dlg.username();
 		QString password = dlg.password();
 		QString domain = dlg.domain();
+		ConnectionOptions options = dlg.options();
 		settings.setValue("Hostname", hostname);
 		settings.setValue("Username", username);
 		settings.setValue("Domain", domain);
-		doConnect(hostname, username, password, domain);
+		settings.setValue("PixelFormat", static_cast<int>(options.pixel_format));
+		settings.setValue("MaxFps", options.max_fps);
+		doConnect(hostname, username, password, domain, options);
 		return;
 	}
 }
@@ -763,42 +1013,194 @@ void MainWindow::on_action_disconnect_triggered()
 	doDisconnect();
 }
 
-void MainWindow::start_rdp_thread()
+void MainWindow::start_rdp_thread(quint64 session_id, QString const &hostname)
+{
+	ResetEvent(m->wakeup_event);
+	m->rdp_thread = std::thread([this, session_id, hostname]() {
+		runRdpThread(session_id, hostname);
+	});
+}
+
+// RDPスレッドで実行する: 接続し、切断されるまでイベントを処理して、切断する
+void MainWindow::runRdpThread(quint64 session_id, QString const &hostname)
 {
-	m->rdp_thread = std::thread([this]() {
-		while (true) {
+	MyView *view = ui->widget_view;
+	freerdp *instance = rdp_instance();
+
+	// 前の接続で積まれたまま送られなかった入力を捨てる(このスレッドがキューの読み出し側)
+	view->discardInput();
+
+	// 途中で中断が要求されると、freerdp_abort_connect_contextによって失敗として戻る
+	const bool connected = !m->interrupted && freerdp_connect(instance);
+	if (connected && !m->interrupted) {
+		setConnectionState(ConnectionState::Active);
+		QMetaObject::invokeMethod(this, [this, session_id, hostname]() {
+			if (session_id != m->session_id || !isConnected()) return;
+			ui->widget_view->setRdpInstance(rdp_instance());
+			statusBar()->showMessage("Connected to " + hostname);
+			setWindowTitle(hostname + " - Radic");
+		}, Qt::QueuedConnection);
+	} else if (!m->interrupted) {
+		const QString reason = QString::fromUtf8(freerdp_get_last_error_string(freerdp_get_last_error(instance->context)));
+		QMetaObject::invokeMethod(this, [this, hostname, reason]() {
+			QMessageBox::critical(this, "Error", "Failed to connect to " + hostname + "\n" + reason);
+		}, Qt::QueuedConnection);
+	}
+
+	// ネットワークが切れたときは、切断せずに同じインスタンスで再接続を試みる
+	bool active = connected && !m->interrupted;
+	while (active) {
+		processRdpEvents(instance);
+		active = !m->interrupted && reconnect(instance);
+	}
+
+	// サーバーから切られた場合も含め、切断はこのスレッドで行う
+	setConnectionState(ConnectionState::Closing);
+	freerdp_disconnect(instance);
+	QMetaObject::invokeMethod(this, [this, session_id]() { finishDisconnect(session_id); }, Qt::QueuedConnection);
+}
+
+// RDPスレッドで実行する: 切断が要求されるか、接続が切れるまでイベントを処理する
+void MainWindow::processRdpEvents(freerdp *instance)
+{
+	MyView *view = ui->widget_view;
+	int input_wait = -1; // 入力の区切りの間隔を待っているときの残り時間(ミリ秒)
+	while (true) {
+		if (m->interrupted) break;
+		if (freerdp_shall_disconnect_context(instance->context)) break;
+		// イベント処理
+		// 先頭にwakeup_eventを置き、ネットワークのイベントと合わせて無期限に待つ。
+		// 何も起きていない間はスレッドが起床しない。入力の区切りを待っているときだけ時間を区切る。
+		HANDLE handles[MAXIMUM_WAIT_OBJECTS] = {};
+		handles[0] = m->wakeup_event;
+		DWORD count = freerdp_get_event_handles(instance->context, handles + 1, MAXIMUM_WAIT_OBJECTS - 1);
+		if (count == 0) break;
+		auto r = WaitForMultipleObjects(count + 1, handles, FALSE, input_wait < 0 ? INFINITE : DWORD(input_wait));
+		if (r == WAIT_FAILED) break;
+		if (r == WAIT_OBJECT_0) {
+			ResetEvent(m->wakeup_event);
 			if (m->interrupted) break;
-			if (rdp_instance() && m->connected) {
-				if (freerdp_shall_disconnect_context(m->session->rdp_context())) {
-					emit emitDisconnect();
-					break;
-				}
-				// イベント処理
-				HANDLE handles[MAXIMUM_WAIT_OBJECTS] = {};
-				int count = freerdp_get_event_handles(rdp_instance()->context, handles, MAXIMUM_WAIT_OBJECTS);
-				auto r = WaitForMultipleObjects(count, handles, FALSE, 1);
-				if (r == WAIT_FAILED) break;
-				if (!freerdp_check_event_handles(rdp_instance()->context)) break;
-				if (rdp_session_version() == RdpSessionVersion::V1) {
-					QImage new_image;
-					if (m->screen_image.isNull()) {
-						auto *gdi = rdp_gdi();
-						if (gdi->primary_buffer) {
-							BYTE *data = gdi->primary_buffer;
-							int width = gdi->width;
-							int height = gdi->height;
-							int stride = gdi->stride;
-							new_image = QImage(data, width, height, stride, m->screen_image_foramt);
-						}
-					}
-					if (!new_image.isNull()) {
-						m->screen_image = new_image;
-						emit requestUpdateScreen();
-					}
+			processRdpThreadRequests();
+		}
+		if (!freerdp_check_event_handles(instance->context)) break;
+		m->stats.recordTransportSent(freerdp_get_transport_sent(instance->context, FALSE));
+		// GUIスレッドが積んだ入力を、ネットワークの処理と同じループで送る
+		input_wait = view->drainInput(instance->context->input);
+		if (rdp_session_version() == RdpSessionVersion::V1) {
+			QImage new_image;
+			if (m->screen_image.isNull()) {
+				auto *gdi = rdp_gdi();
+				if (gdi->primary_buffer) {
+					BYTE *data = gdi->primary_buffer;
+					int width = gdi->width;
+					int height = gdi->height;
+					int stride = gdi->stride;
+					new_image = QImage(data, width, height, stride, m->screen_image_foramt);
 				}
 			}
+			if (!new_image.isNull()) {
+				m->screen_image = new_image;
+				emit requestUpdateScreen();
+			}
 		}
-	});
+	}
+}
+
+// RDPスレッドで実行する: ネットワークの切断から、サーバーの自動再接続のクッキーを使って
+// セッションへ戻る。間隔を倍々に空けながら試し、切断が要求されたらすぐにあきらめる。
+// GDIと画面のバッファはそのまま使い回すので、最後のフレームは暗くして表示しておく。
+bool MainWindow::reconnect(freerdp *instance)
+{
+	// ログオフや管理者による切断など、サーバーが意図して切ったときは再接続しない
+	const UINT32 error_info = freerdp_error_info(instance);
+	if (error_info != ERRINFO_SUCCESS && error_info != ERRINFO_GRAPHICS_SUBSYSTEM_FAILED) return false;
+	if (!freerdp_settings_get_bool(instance->context->settings, FreeRDP_AutoReconnectionEnabled)) return false;
+
+	MyView *view = ui->widget_view;
+	const qint64 start = FrameStats::now();
+	int delay = RECONNECT_INITIAL_DELAY_MS;
+
+	// 接続中に計測した回線の状態で、コーデックと圧縮を選び直す
+	rdpSettings *settings = instance->context->settings;
+	m->network_profile = NetworkProfiles::select(m->network);
+	NetworkProfiles::applyCodec(settings, m->network_profile, rdp_session_version() == RdpSessionVersion::V2);
+	NetworkProfiles::applyCompression(settings, m->network);
+	postNetworkStatus();
+	for (int attempt = 1; attempt <= RECONNECT_MAX_ATTEMPTS; attempt++) {
+		m->reconnect_attempt = attempt;
+		setConnectionState(ConnectionState::Reconnecting);
+		if (m->interrupted) return false;
+		if (freerdp_reconnect(instance)) {
+			// 切れている間に積まれた入力は、戻った先のセッションへは送らない
+			view->discardInput();
+			view->recordReconnect(FrameStats::now() - start);
+			setConnectionState(ConnectionState::Active);
+			QMetaObject::invokeMethod(this, [this]() {
+				if (!isConnected()) return;
+				statusBar()->showMessage(tr("Reconnected to %1").arg(m->hostname));
+				resizeDynamicLater();
+			}, Qt::QueuedConnection);
+			// 待っている間に届いた依頼(解像度の変更など)を処理する
+			processRdpThreadRequests();
+			return true;
+		}
+		if (m->interrupted) return false;
+		if (freerdp_get_last_error(instance->context) == FREERDP_ERROR_CONNECT_CANCELLED) return false;
+
+		// 次の試行まで待つ。入力などで起こされても、切断の要求でなければ待ち続ける。
+		const qint64 deadline = FrameStats::now() + qint64(delay) * 1000000;
+		while (!m->interrupted) {
+			const qint64 remaining = deadline - FrameStats::now();
+			if (remaining <= 0) break;
+			if (WaitForSingleObject(m->wakeup_event, DWORD(remaining / 1000000) + 1) == WAIT_OBJECT_0) {
+				ResetEvent(m->wakeup_event);
+				view->discardInput();
+			}
+		}
+		delay = std::min(delay * 2, RECONNECT_MAX_DELAY_MS);
+	}
+	return false;
+}
+
+// RDPスレッドで実行する: GUIスレッドから依頼された処理を行う
+void MainWindow::processRdpThreadRequests()
+{
+	QSize size;
+	{
+		std::lock_guard lock(m->request_mutex);
+		std::swap(size, m->requested_size);
+	}
+	if (size.isValid()) {
+		applyDesktopSize(size);
+	}
+	if (m->damage_waiting) {
+		flushDamage();
+	}
+}
+
+// RDPスレッドで実行する: 溜まった差分をまとめてMyViewへ渡す。
+// 前のフレームがまだ表示されていなければ差分は溜めたままにし、
+// 表示された時点でRDPスレッドが起こされてもう一度ここへ来る。
+void MainWindow::flushDamage()
+{
+	if (m->pending_damage.isEmpty()) return;
+	// 接続が確立するまで(再接続の間も含む)は溜めておき、MyViewの表示待ちにしない
+	if (!isConnected()) return;
+
+	// v2_paint_pendingより先にdamage_waitingを立てておくことで、GUIスレッドが
+	// フラグを解除した直後に見落として起こしそびれることがないようにする
+	m->damage_waiting = true;
+	if (m->v2_paint_pending.exchange(true)) return;
+	m->damage_waiting = false;
+
+	std::vector<QRect> &rects = m->damage_rects;
+	rects.assign(m->pending_damage.begin(), m->pending_damage.end());
+	const qint64 end_paint_time = m->pending_damage_time;
+	m->pending_damage.clear();
+	m->pending_damage_time = 0;
+
+	m->frame_recorder.write(end_paint_time, m->screen_image, rects);
+	updateScreen2(m->screen_image, rects, end_paint_time);
 }
 
 void MainWindow::closeEvent(QCloseEvent *event)
@@ -820,14 +1222,14 @@ void MainWindow::closeEvent(QCloseEvent *event)
 		return;
 	}
 
-	if (m->connected) {
+	if (isConnected()) {
 		if (QMessageBox::question(this, "Confirm Disconnect", "Are you sure you want to close Remote Desktop Client?", QMessageBox::Yes | QMessageBox::No, QMessageBox::No) != QMessageBox::Yes) {
 			event->ignore();
 			return;
 		}
 	}
 
-	doDisconnect();
+	waitForDisconnect();
 
 	{
 		MySettings settings;
@@ -859,29 +1261,54 @@ BOOL MainWindow::rdp_pre_connect(freerdp *rdp)
 	return TRUE;
 }
 
+// RDPスレッドで実行する
 BOOL MainWindow::onRdpPostConnect(freerdp *rdp)
 {
+	setConnectionState(ConnectionState::Capabilities);
+	// サーバーが決めたデスクトップの大きさ。要求した大きさと違うことがあり、再接続で変わることもある。
+	auto *settings = rdp->context->settings;
+	const UINT32 width = freerdp_settings_get_uint32(settings, FreeRDP_DesktopWidth);
+	const UINT32 height = freerdp_settings_get_uint32(settings, FreeRDP_DesktopHeight);
+	// freerdp_reconnectはPostDisconnectを呼ばないので、自動再接続のときはGDIが残っている。
+	// 残っていれば作り直さずに、大きさが変わったときだけリサイズする。
+	// (PostDisconnectでGDIが解放されていれば、初めての接続と同じく作る)
 	if (rdp_session_version() == RdpSessionVersion::V1) {
-		if (!gdi_init(rdp, m->rdp_pixel_format)) {
+		if (rdpGdi *gdi = rdp->context->gdi) {
+			if ((gdi->width != width || gdi->height != height) && !gdi_resize(gdi, width, height)) {
+				return FALSE;
+			}
+		} else if (!gdi_init(rdp, m->rdp_pixel_format)) {
 			return FALSE;
 		}
+		registerPointer(rdp->context);
 	} else if (rdp_session_version() == RdpSessionVersion::V2) {
-		m->screen_image = QImage(m->size.width(), m->size.height(), m->screen_image_foramt);
-		if (!gdi_init_ex(rdp, m->rdp_pixel_format, m->screen_image.bytesPerLine(), m->screen_image.bits(), nullptr)) {
-			return FALSE;
-		}
-		if (isDynamicResizingEnabled()) {
-			resizeDynamicLater();
+		if (rdpGdi *gdi = rdp->context->gdi) {
+			// 画面のバッファはGDIの描画先なので、大きさが同じなら使い回す
+			if (m->screen_image.width() != int(width) || m->screen_image.height() != int(height)) {
+				m->screen_image = QImage(width, height, m->screen_image_foramt);
+				if (!gdi_resize_ex(gdi, width, height, m->screen_image.bytesPerLine(), m->rdp_pixel_format, m->screen_image.bits(), nullptr)) {
+					return FALSE;
+				}
+			}
+		} else {
+			// gdi_init_exは設定のデスクトップの大きさでGDIを作るので、バッファも同じ大きさにする
+			m->screen_image = QImage(width, height, m->screen_image_foramt);
+			if (!gdi_init_ex(rdp, m->rdp_pixel_format, m->screen_image.bytesPerLine(), m->screen_image.bits(), nullptr)) {
+				return FALSE;
+			}
 		}
+		// タイマーはGUIスレッドのものなので、そちらで動かす
+		QMetaObject::invokeMethod(this, [this]() { resizeDynamicLater(); }, Qt::QueuedConnection);
 		setupRdpContext(rdp->context);
+		registerPointer(rdp->context);
 	}
 	return TRUE;
 }
 
 BOOL MainWindow::rdp_post_connect(freerdp *instance)
 {
-	if (global->mainwindow) {
-		return global->mainwindow->onRdpPostConnect(instance);
+	if (MainWindow *self = windowOf(instance->context)) {
+		return self->onRdpPostConnect(instance);
 	}
 	return FALSE;
 }
@@ -893,10 +1320,12 @@ void MainWindow::rdp_post_disconnect(freerdp *instance)
 
 BOOL MainWindow::rdp_authenticate(freerdp *instance, char **username, char **password, char **domain)
 {
-	(void)instance;
 	(void)username;
 	(void)password;
 	(void)domain;
+	if (MainWindow *self = windowOf(instance->context)) {
+		self->setConnectionState(ConnectionState::Auth);
+	}
 	return TRUE;
 }
 
@@ -934,8 +1363,12 @@ DWORD MainWindow::verifyCertificateEx(freerdp *rdp,
 DWORD MainWindow::rdp_verify_certificate_ex(freerdp *rdp, const char *host, UINT16 port, const char *common_name, const char *subject, const char *issuer, const char *fingerprint, DWORD flags)
 {
 	qDebug() << Q_FUNC_INFO;
-	if (global->mainwindow) {
-		return global->mainwindow->verifyCertificateEx(rdp, host, port, common_name, subject, issuer, fingerprint, flags);
+	if (MainWindow *self = windowOf(rdp->context)) {
+		// RDPスレッドから呼ばれるので、ダイアログはGUIスレッドで出して結果を待つ
+		self->setConnectionState(ConnectionState::Tls);
+		return self->callOnGuiThread([=]() {
+			return self->verifyCertificateEx(rdp, host, port, common_name, subject, issuer, fingerprint, flags);
+		}, 0);
 	}
 	return 0;
 }
@@ -984,8 +1417,11 @@ DWORD MainWindow::rdp_verify_change_certificate_ex(freerdp *instance, const char
 												   const char *old_fingerprint, DWORD flags)
 {
 	qDebug() << Q_FUNC_INFO;
-	if (global->mainwindow) {
-		return global->mainwindow->onRdpVerifyChangeCertificateEx(instance, host, port, common_name, subject, issuer, new_fingerprint, old_subject, old_issuer, old_fingerprint, flags);
+	if (MainWindow *self = windowOf(instance->context)) {
+		self->setConnectionState(ConnectionState::Tls);
+		return self->callOnGuiThread([=]() {
+			return self->onRdpVerifyChangeCertificateEx(instance, host, port, common_name, subject, issuer, new_fingerprint, old_subject, old_issuer, old_fingerprint, flags);
+		}, 0);
 	}
 	return 0;
 }
@@ -998,25 +1434,36 @@ BOOL MainWindow::rdp_end_paint(rdpContext *context)
 	MainWindow *self = ctx->self;
 	rdpGdi *gdi = self->rdp_gdi();
 	if (!gdi || !gdi->primary) return FALSE;
-
-	// MyView側が前回のフレームをまだ消費していない場合、ここで全画面コピーを
-	// 行っても表示される前に上書きされて捨てられるだけなので、コピー自体を
-	// スキップしてRDP処理スレッドを解放する。screen_imageは以後もGDIによって
-	// 更新され続けるため、次にここへ来たときには最新の累積状態を取得できる。
-	if (self->m->v2_paint_pending.exchange(true)) {
-		return TRUE;
+	const qint64 end_paint_time = FrameStats::now();
+
+	HGDI_WND hwnd = gdi->primary->hdc->hwnd;
+	if (!hwnd || !hwnd->invalid || hwnd->invalid->null) return TRUE;
+
+	// 外接矩形(invalid)だけでなく、個々の無効矩形(cinvalid)を拾って
+	// 変化した部分だけを溜める。GDIの無効領域は毎回リセットする。
+	Private *m = self->m;
+	// 前のフレームの差分がまだ渡せずに残っていれば、このフレームとまとめて渡すことになる
+	m->stats.recordFrame(!m->pending_damage.isEmpty());
+	bool found = false;
+	for (INT32 i = 0; i < hwnd->ninvalid; i++) {
+		GDI_RGN const &r = hwnd->cinvalid[i];
+		if (r.null || r.w <= 0 || r.h <= 0) continue;
+		m->pending_damage.add(QRect(r.x, r.y, r.w, r.h));
+		found = true;
+	}
+	if (!found) {
+		m->pending_damage.add(QRect(hwnd->invalid->x, hwnd->invalid->y, hwnd->invalid->w, hwnd->invalid->h));
+	}
+	hwnd->invalid->null = TRUE;
+	hwnd->ninvalid = 0;
+	if (m->pending_damage_time == 0) {
+		m->pending_damage_time = end_paint_time;
 	}
 
-	auto invalid = gdi->primary->hdc->hwnd->invalid;
-	QRect rect(invalid->x, invalid->y, invalid->w, invalid->h);
-
-#if 1
-	QImage img = self->m->screen_image.copy();
-#else
-	QImage img(self->m->screen_image.width(), self->m->screen_image.height(), self->m->screen_image.format());
-	memcpy(img.bits(), self->m->screen_image.bits(), img.bytesPerLine() * img.height());
-#endif
-	self->updateScreen2(img, rect);
+	// MyView側が前回のフレームをまだ消費していない場合、ここでコピーを
+	// 行っても表示される前に上書きされて捨てられるだけなので、差分を溜めるだけにして
+	// RDP処理スレッドを解放する。溜めた差分は次に渡せるときにまとめて渡す。
+	self->flushDamage();
 
 	return TRUE;
 }
@@ -1034,6 +1481,222 @@ BOOL MainWindow::rdp_resize_display(rdpContext *context)
 }
 
 
+// サーバーのポインタの形状をARGB32の画像へ一度だけ変換し、GUIスレッドのカーソルのキャッシュへ渡す
+BOOL MainWindow::rdp_pointer_new(rdpContext *context, rdpPointer *pointer)
+{
+	static std::atomic<quint64> next_id { 1 };
+	auto *p = reinterpret_cast<RadicPointer *>(pointer);
+	p->id = next_id++;
+
+	const int w = std::max<int>(pointer->width, 1);
+	const int h = std::max<int>(pointer->height, 1);
+	QImage image(w, h, QImage::Format_ARGB32); // リトルエンディアンではBGRAの並び
+	image.fill(Qt::transparent);
+	if (pointer->width > 0 && pointer->height > 0) {
+		const gdiPalette *palette = context->gdi ? &context->gdi->palette : nullptr;
+		if (!freerdp_image_copy_from_pointer_data(image.bits(), PIXEL_FORMAT_BGRA32, image.bytesPerLine(), 0, 0,
+												  pointer->width, pointer->height,
+												  pointer->xorMaskData, pointer->lengthXorMask,
+												  pointer->andMaskData, pointer->lengthAndMask,
+												  pointer->xorBpp, palette)) {
+			return FALSE;
+		}
+	}
+
+	if (MainWindow *self = windowOf(context)) {
+		MyView *view = self->ui->widget_view;
+		const quint64 id = p->id;
+		const QPoint hotspot(pointer->xPos, pointer->yPos);
+		QMetaObject::invokeMethod(view, [view, id, image, hotspot]() {
+			view->addRemoteCursor(id, image, hotspot);
+		}, Qt::QueuedConnection);
+	}
+	return TRUE;
+}
+
+void MainWindow::rdp_pointer_free(rdpContext *context, rdpPointer *pointer)
+{
+	auto *p = reinterpret_cast<RadicPointer *>(pointer);
+	MainWindow *self = windowOf(context);
+	if (self && p->id != 0) {
+		MyView *view = self->ui->widget_view;
+		const quint64 id = p->id;
+		QMetaObject::invokeMethod(view, [view, id]() {
+			view->removeRemoteCursor(id);
+		}, Qt::QueuedConnection);
+	}
+}
+
+BOOL MainWindow::rdp_pointer_set(rdpContext *context, rdpPointer *pointer)
+{
+	auto *p = reinterpret_cast<RadicPointer *>(pointer);
+	if (MainWindow *self = windowOf(context)) {
+		MyView *view = self->ui->widget_view;
+		const quint64 id = p->id;
+		QMetaObject::invokeMethod(view, [view, id]() {
+			view->setRemoteCursor(id);
+		}, Qt::QueuedConnection);
+	}
+	return TRUE;
+}
+
+BOOL MainWindow::rdp_pointer_set_null(rdpContext *context)
+{
+	if (MainWindow *self = windowOf(context)) {
+		MyView *view = self->ui->widget_view;
+		QMetaObject::invokeMethod(view, &MyView::setRemoteCursorHidden, Qt::QueuedConnection);
+	}
+	return TRUE;
+}
+
+BOOL MainWindow::rdp_pointer_set_default(rdpContext *context)
+{
+	if (MainWindow *self = windowOf(context)) {
+		MyView *view = self->ui->widget_view;
+		QMetaObject::invokeMethod(view, &MyView::setRemoteCursorDefault, Qt::QueuedConnection);
+	}
+	return TRUE;
+}
+
+BOOL MainWindow::rdp_pointer_set_position(rdpContext *context, UINT32 x, UINT32 y)
+{
+	if (MainWindow *self = windowOf(context)) {
+		MyView *view = self->ui->widget_view;
+		const QPoint pos(x, y);
+		QMetaObject::invokeMethod(view, [view, pos]() {
+			view->moveRemoteCursor(pos);
+		}, Qt::QueuedConnection);
+	}
+	return TRUE;
+}
+
+BOOL MainWindow::rdp_network_characteristics_result(rdpAutoDetect *autodetect, RDP_TRANSPORT_TYPE transport, UINT16 sequenceNumber, const rdpNetworkCharacteristicsResult *result)
+{
+	if (MainWindow *self = windowOf(autodetect->context)) {
+		self->onNetworkCharacteristics(*result);
+	}
+	return TRUE;
+}
+
+// RDPスレッドで実行する: サーバーが計測した回線の状態を受け取る
+void MainWindow::onNetworkCharacteristics(rdpNetworkCharacteristicsResult const &result)
+{
+	// 結果の種類によって、最小のRTTか帯域のどちらかが含まれないことがある
+	NetworkMeasurement &n = m->network;
+	if (result.type != RDP_NETCHAR_RESULT_TYPE_BW_AVG_RTT) {
+		n.base_rtt_ms = result.baseRTT;
+	}
+	if (result.type != RDP_NETCHAR_RESULT_TYPE_BASE_RTT_AVG_RTT) {
+		n.bandwidth_kbps = result.bandwidth;
+	}
+	n.average_rtt_ms = result.averageRTT;
+	n.samples++;
+	m->stats.recordNetwork(n.average_rtt_ms, n.bandwidth_kbps);
+
+	// アクティブになる前(接続時の自動検出)なら、Graphics Pipelineのコーデックはまだ交渉していないので、
+	// この接続から選んだものを使える。圧縮とアクティブになった後の変化は次の再接続で反映する。
+	const NetworkProfile profile = NetworkProfiles::select(n);
+	if (m->state != ConnectionState::Active && profile != m->network_profile) {
+		m->network_profile = profile;
+		NetworkProfiles::applyCodec(rdp_instance()->context->settings, profile, rdp_session_version() == RdpSessionVersion::V2);
+	}
+	postNetworkStatus();
+}
+
+// RDPスレッドから呼ぶ: 回線の状態をGUIスレッドで表示させる
+void MainWindow::postNetworkStatus()
+{
+	const NetworkMeasurement network = m->network;
+	const NetworkProfile profile = m->network_profile;
+	const NetworkProfile next = NetworkProfiles::select(network);
+	QMetaObject::invokeMethod(this, [this, network, profile, next]() {
+		if (m->state == ConnectionState::Disconnected) return;
+		showNetworkStatus(network, profile, next);
+	}, Qt::QueuedConnection);
+}
+
+void MainWindow::showNetworkStatus(NetworkMeasurement const &network, NetworkProfile profile, NetworkProfile next)
+{
+	QString text = NetworkProfiles::name(profile);
+	if (network.isValid()) {
+		text += tr(" / RTT %1 ms").arg(network.average_rtt_ms);
+		if (network.bandwidth_kbps != 0) {
+			text += tr(" / %1 Mbps").arg(network.bandwidth_kbps / 1000.0, 0, 'f', 1);
+		}
+	} else {
+		text += tr(" / measuring...");
+	}
+	if (next != profile) {
+		// 接続中には切り替えられないので、次の再接続で使うものを示す
+		text += tr(" (next reconnect: %1)").arg(NetworkProfiles::name(next));
+	}
+	m->network_label->setText(text);
+}
+
+BOOL MainWindow::rdp_send_channel_data(freerdp *instance, UINT16 channelId, const BYTE *data, size_t size)
+{
+	MyClientContext *ctx = reinterpret_cast<MyClientContext *>(instance->context);
+	if (ctx->self) {
+		ctx->self->m->stats.recordChannelOut(instance, channelId, size);
+	}
+	return ctx->send_channel_data(instance, channelId, data, size);
+}
+
+BOOL MainWindow::rdp_receive_channel_data(freerdp *instance, UINT16 channelId, const BYTE *data, size_t size, UINT32 flags, size_t totalSize)
+{
+	MyClientContext *ctx = reinterpret_cast<MyClientContext *>(instance->context);
+	if (ctx->self) {
+		ctx->self->m->stats.recordChannelIn(instance, channelId, size);
+	}
+	return ctx->receive_channel_data(instance, channelId, data, size, flags, totalSize);
+}
+
+// Graphics Pipelineのチャネルのスレッドで実行する
+UINT MainWindow::rdpgfx_surface_command(RdpgfxClientContext *gfx, const RDPGFX_SURFACE_COMMAND *cmd)
+{
+	// customはgdi_graphics_pipeline_initが設定したGDI
+	rdpGdi *gdi = static_cast<rdpGdi *>(gfx->custom);
+	MyClientContext *ctx = reinterpret_cast<MyClientContext *>(gdi->context);
+	const qint64 start = FrameStats::now();
+	const UINT status = ctx->gfx_surface_command(gfx, cmd);
+	if (ctx->self) {
+		ctx->self->m->stats.recordSurfaceCommand(cmd->codecId, FrameStats::now() - start);
+	}
+	return status;
+}
+
+// 1秒ごとに統計を読み出して表示し、間隔ごとにログへ書く
+void MainWindow::updateSessionStats()
+{
+	if (m->state == ConnectionState::Disconnected) return;
+	const SessionStatsSample sample = m->stats.sample(&m->stats_view_cursor);
+	m->stats_label->setText(sample.summary());
+	ui->widget_view->setSessionStatistics(sample.overlayLines());
+	if (m->stats_log_interval > 0 && ++m->stats_log_elapsed >= m->stats_log_interval) {
+		m->stats_log_elapsed = 0;
+		writeSessionStatsLog();
+	}
+}
+
+// 前に書いてからの区間の統計を、JSONの1行としてapp_config_dir/session_stats_*.jsonlへ追記する
+void MainWindow::writeSessionStatsLog()
+{
+	if (m->stats_log_interval <= 0) return;
+	const SessionStatsSample sample = m->stats.sample(&m->stats_log_cursor);
+	if (sample.seconds <= 0) return;
+	if (!m->stats_log.isOpen()) {
+		QDir().mkpath(global->app_config_dir);
+		m->stats_log.setFileName(global->app_config_dir / "session_stats_" + QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss") + ".jsonl");
+		if (!m->stats_log.open(QIODevice::WriteOnly | QIODevice::Append)) return;
+	}
+	QJsonObject obj = sample.toJson();
+	obj["time"] = QDateTime::currentDateTime().toString(Qt::ISODateWithMs);
+	obj["host"] = m->hostname;
+	obj["profile"] = NetworkProfiles::name(m->network_profile);
+	m->stats_log.write(QJsonDocument(obj).toJson(QJsonDocument::Compact) + '\n');
+	m->stats_log.flush();
+}
+
 bool MainWindow::isDynamicResizingEnabled() const
 {
 	return ui->action_view_dynamic_resolution->isChecked();
@@ -1049,60 +1712,77 @@ void MainWindow::on_action_view_dynamic_resolution_toggled(bool arg1)
 
 void MainWindow::resizeDynamicLater()
 {
-	m->dynamic_resize_counter = isDynamicResizingEnabled() ? 50 : 0;
+	if (isDynamicResizingEnabled()) {
+		m->resize_timer.start();
+	} else {
+		m->resize_timer.stop();
+	}
 }
 
 void MainWindow::resizeDynamic()
 {
 	if (m->interrupted) return;
-	if (!m->connected) return;
+	if (!isConnected()) return;
 	if (!rdp_instance()) return;
 	if (isDynamicResizingEnabled()) {
 		auto size = newSize();
 		if (size != m->size) {
 			m->size = size;
-			auto *settings = rdp_settings();
-			auto *disp = disp_client_context();
-			if (settings && disp && disp->DisplayControlCaps) {
-				DISPLAY_CONTROL_MONITOR_LAYOUT layout = { 0 };
-				layout.Flags = DISPLAY_CONTROL_MONITOR_PRIMARY;
-				layout.Left = 0;
-				layout.Top = 0;
-				layout.Width = m->size.width();
-				layout.Height = m->size.height();
-				layout.PhysicalWidth = m->size.width();
-				layout.PhysicalHeight = m->size.height();
-				layout.Orientation = freerdp_settings_get_uint16(settings, FreeRDP_DesktopOrientation);
-				layout.DesktopScaleFactor = freerdp_settings_get_uint32(settings, FreeRDP_DesktopScaleFactor);
-				layout.DeviceScaleFactor = freerdp_settings_get_uint32(settings, FreeRDP_DeviceScaleFactor);
-
-				disp->SendMonitorLayout(disp, 1, &layout);
-
-				freerdp_settings_set_uint32(settings, FreeRDP_DesktopWidth, m->size.width());
-				freerdp_settings_set_uint32(settings, FreeRDP_DesktopHeight, m->size.height());
-
-				auto gdi = rdp_gdi();
-				if (gdi) {
-					if (rdp_session_version() == RdpSessionVersion::V1) {
-						gdi_resize(gdi, m->size.width(), m->size.height());
-					} else if (rdp_session_version() == RdpSessionVersion::V2) {
-						m->screen_image = QImage(m->size, m->screen_image_foramt);
-						gdi_resize_ex(gdi, m->size.width(), m->size.height(), m->screen_image.bytesPerLine(), m->rdp_pixel_format, m->screen_image.bits(), nullptr);
-					}
-				}
+			// モニタレイアウトの送信とGDIのリサイズは、GDIに描画しているRDPスレッドで行う
+			{
+				std::lock_guard lock(m->request_mutex);
+				m->requested_size = size;
 			}
+			wakeupRdpThread();
 		}
 	}
 	ui->widget_view->layoutView(true);
 }
 
+// RDPスレッドで実行する
+void MainWindow::applyDesktopSize(const QSize &size)
+{
+	auto *settings = rdp_settings();
+	auto *disp = disp_client_context();
+	if (settings && disp && disp->DisplayControlCaps) {
+		DISPLAY_CONTROL_MONITOR_LAYOUT layout = { 0 };
+		layout.Flags = DISPLAY_CONTROL_MONITOR_PRIMARY;
+		layout.Left = 0;
+		layout.Top = 0;
+		layout.Width = size.width();
+		layout.Height = size.height();
+		layout.PhysicalWidth = size.width();
+		layout.PhysicalHeight = size.height();
+		layout.Orientation = freerdp_settings_get_uint16(settings, FreeRDP_DesktopOrientation);
+		layout.DesktopScaleFactor = freerdp_settings_get_uint32(settings, FreeRDP_DesktopScaleFactor);
+		layout.DeviceScaleFactor = freerdp_settings_get_uint32(settings, FreeRDP_DeviceScaleFactor);
+
+		disp->SendMonitorLayout(disp, 1, &layout);
+
+		freerdp_settings_set_uint32(settings, FreeRDP_DesktopWidth, size.width());
+		freerdp_settings_set_uint32(settings, FreeRDP_DesktopHeight, size.height());
+
+		auto gdi = rdp_gdi();
+		if (gdi) {
+			if (rdp_session_version() == RdpSessionVersion::V1) {
+				gdi_resize(gdi, size.width(), size.height());
+			} else if (rdp_session_version() == RdpSessionVersion::V2) {
+				m->screen_image = QImage(size, m->screen_image_foramt);
+				gdi_resize_ex(gdi, size.width(), size.height(), m->screen_image.bytesPerLine(), m->rdp_pixel_format, m->screen_image.bits(), nullptr);
+			}
+		}
+	}
+}
+
 void MainWindow::channelConnected(void *context, const ChannelConnectedEventArgs *e)
 {
+	// contextはこのセッションのrdpContext
+	MainWindow *self = windowOf(reinterpret_cast<rdpContext *>(context));
 	if (strcmp(e->name, CLIPRDR_SVC_CHANNEL_NAME) == 0) {
-		if (global->mainwindow) {
-			auto *self = global->mainwindow;
+		if (self) {
 			auto *cliprdr = reinterpret_cast<CliprdrClientContext *>(e->pInterface);
 			self->m->cliprdr = cliprdr;
+			self->m->remote_clipboard->setChannel(cliprdr);
 			cliprdr->custom = self;
 			cliprdr->MonitorReady = cliprdrMonitorReady;
 			cliprdr->ServerFormatList = cliprdrServerFormatList;
@@ -1110,10 +1790,8 @@ void MainWindow::channelConnected(void *context, const ChannelConnectedEventArgs
 			cliprdr->ServerFormatDataResponse = cliprdrServerFormatDataResponse;
 		}
 	} else if (strcmp(e->name, DISP_DVC_CHANNEL_NAME) == 0) {
-		// contextをMyClientContext*として読み書きできるのは、V2(freerdp_client_context_new)で
-		// ContextSize=sizeof(MyClientContext)として確保された場合のみ。V1(freerdp_context_new)の
-		// contextは素のrdpContextでこれより小さいため、キャストして触れると領域外アクセスになる。
-		if (global->mainwindow && global->mainwindow->rdp_session_version() == RdpSessionVersion::V2) {
+		// V1はDisplay Controlを使わない(動的解像度を無効にしている)
+		if (self && self->rdp_session_version() == RdpSessionVersion::V2) {
 			MyClientContext *ctx = reinterpret_cast<MyClientContext *>(context);
 			ctx->disp = reinterpret_cast<DispClientContext *>(e->pInterface);
 			ctx->disp->DisplayControlCaps = onDisplayControlCaps;
@@ -1121,25 +1799,32 @@ void MainWindow::channelConnected(void *context, const ChannelConnectedEventArgs
 		}
 	} else {
 		freerdp_client_OnChannelConnectedEventHandler(context, e);
+		if (strcmp(e->name, RDPGFX_DVC_CHANNEL_NAME) == 0 && self) {
+			// GDIが設定したサーフェスコマンドの処理を中継し、コーデックとデコードの時間を数える
+			auto *gfx = reinterpret_cast<RdpgfxClientContext *>(e->pInterface);
+			MyClientContext *ctx = reinterpret_cast<MyClientContext *>(context);
+			if (gfx->SurfaceCommand && gfx->SurfaceCommand != rdpgfx_surface_command) {
+				ctx->gfx_surface_command = gfx->SurfaceCommand;
+				gfx->SurfaceCommand = rdpgfx_surface_command;
+			}
+		}
 	}
 }
 
 void MainWindow::channelDisconnected(void *context, const ChannelDisconnectedEventArgs *e)
 {
+	MainWindow *self = windowOf(reinterpret_cast<rdpContext *>(context));
 	if (strcmp(e->name, CLIPRDR_SVC_CHANNEL_NAME) == 0) {
-		if (global->mainwindow) {
-			auto *self = global->mainwindow;
+		if (self) {
 			if (self->m->cliprdr) {
 				self->m->cliprdr->custom = nullptr;
 			}
 			self->m->cliprdr = nullptr;
-			self->m->requested_clipboard_format = 0;
-			self->m->remote_clipboard_generation++;
-			self->m->remote_clipboard_request_attempts = 0;
+			self->m->remote_clipboard->setChannel(nullptr);
 		}
 	} else if (strcmp(e->name, DISP_DVC_CHANNEL_NAME) == 0) {
-		if (global->mainwindow && global->mainwindow->rdp_session_version() == RdpSessionVersion::V2) {
-			MyClientContext *ctx = reinterpret_cast<MyClientContext *>(context);
+		MyClientContext *ctx = reinterpret_cast<MyClientContext *>(context);
+		if (self && ctx->disp) {
 			ctx->disp->custom = nullptr;
 			ctx->disp = nullptr;
 		}
@@ -1153,19 +1838,23 @@ void MainWindow::sendClipboardFormatList()
 	auto *cliprdr = m->cliprdr;
 	if (!cliprdr || !cliprdr->ClientFormatList) return;
 
-	const QMimeData *mime = QApplication::clipboard()->mimeData();
-	m->local_clipboard_has_text = mime && mime->hasText();
-	m->local_clipboard_has_image = mime && mime->hasImage();
-	m->local_clipboard_text = m->local_clipboard_has_text ? mime->text() : QString();
-	m->local_clipboard_image = m->local_clipboard_has_image
-		? QApplication::clipboard()->image() : QImage();
-	m->local_clipboard_has_image = !m->local_clipboard_image.isNull();
+	// 要求はチャネルのスレッドで処理するので、ここで取り出しておく。DIBへの変換は要求されるまで行わない。
+	// 取り出しはすべてのウィンドウで共有し、クリップボードが変わってから最初の1回だけ行う。
+	auto snapshot = LocalClipboard::instance()->capture();
+	// このセッションのサーバーから来た内容は送り返さない
+	if (snapshot->isFrom(m->remote_clipboard.get())) return;
 
-	CLIPRDR_FORMAT formats[2] = {};
+	CLIPRDR_FORMAT formats[3] = {};
 	UINT32 count = 0;
 	// 画像編集アプリが列挙順を優先度として扱う場合に備え、画像を先に提示する。
-	if (m->local_clipboard_has_image) formats[count++].formatId = CF_DIB;
-	if (m->local_clipboard_has_text) formats[count++].formatId = CF_UNICODETEXT;
+	// PNGを受け取れる相手にはそちらを使わせ、CF_DIBは受け取れない相手のために残す。
+	if (snapshot->hasImage()) {
+		formats[count].formatId = CLIENT_PNG_FORMAT_ID;
+		formats[count].formatName = const_cast<char *>(ClipboardCodec::PNG_FORMAT_NAME);
+		count++;
+		formats[count++].formatId = CF_DIB;
+	}
+	if (snapshot->hasText()) formats[count++].formatId = CF_UNICODETEXT;
 	if (count == 0) return;
 	CLIPRDR_FORMAT_LIST list = {};
 	list.numFormats = count;
@@ -1207,162 +1896,123 @@ UINT MainWindow::cliprdrServerFormatList(CliprdrClientContext *cliprdr, const CL
 
 	bool hasUnicodeText = false;
 	bool hasDib = false;
+	UINT32 pngFormat = 0; // 登録形式のIDはサーバーごとに異なるので、名前で探す
 	for (UINT32 i = 0; i < formatList->numFormats; ++i) {
-		hasUnicodeText |= formatList->formats[i].formatId == CF_UNICODETEXT;
-		hasDib |= formatList->formats[i].formatId == CF_DIB;
-	}
-	const UINT32 requestedFormat = hasDib ? CF_DIB : (hasUnicodeText ? CF_UNICODETEXT : 0);
-	if (requestedFormat != 0 && cliprdr->ClientFormatDataRequest) {
-		auto *self = static_cast<MainWindow *>(cliprdr->custom);
-		if (self) {
-			QMetaObject::invokeMethod(self, [self, cliprdr, requestedFormat]() {
-				self->beginRemoteClipboardRequest(cliprdr, requestedFormat);
-			}, Qt::QueuedConnection);
+		const CLIPRDR_FORMAT &format = formatList->formats[i];
+		hasUnicodeText |= format.formatId == CF_UNICODETEXT;
+		hasDib |= format.formatId == CF_DIB;
+		if (format.formatName && qstricmp(format.formatName, ClipboardCodec::PNG_FORMAT_NAME) == 0) {
+			pngFormat = format.formatId;
 		}
 	}
-	return CHANNEL_RC_OK;
-}
+	if (!hasUnicodeText && !hasDib && !pngFormat) return CHANNEL_RC_OK;
 
-void MainWindow::beginRemoteClipboardRequest(CliprdrClientContext *cliprdr, UINT32 format)
-{
-	if (m->cliprdr != cliprdr) return;
-	const quint64 generation = ++m->remote_clipboard_generation;
-	m->remote_clipboard_request_attempts = 0;
-	QTimer::singleShot(30, this, [this, cliprdr, generation, format]() {
-		requestRemoteClipboardData(cliprdr, generation, format);
-	});
+	// ここでは中身を取りに行かず、形式だけを持つQMimeDataをローカルのクリップボードへ置く
+	auto *self = static_cast<MainWindow *>(cliprdr->custom);
+	if (self) {
+		const quint64 generation = self->m->remote_clipboard->announce();
+		QMetaObject::invokeMethod(self, [self, generation, hasUnicodeText, hasDib, pngFormat]() {
+			self->setRemoteClipboard(generation, hasUnicodeText, hasDib, pngFormat);
+		}, Qt::QueuedConnection);
+	}
+	return CHANNEL_RC_OK;
 }
 
-void MainWindow::requestRemoteClipboardData(CliprdrClientContext *cliprdr, quint64 generation, UINT32 format)
+void MainWindow::setRemoteClipboard(quint64 generation, bool has_text, bool has_dib, UINT32 png_format)
 {
-	if (m->cliprdr != cliprdr || m->remote_clipboard_generation != generation ||
-		!cliprdr->ClientFormatDataRequest || m->remote_clipboard_request_attempts >= 5) {
-		return;
-	}
-
-	m->remote_clipboard_request_attempts++;
-	m->requested_clipboard_format = format;
-	CLIPRDR_FORMAT_DATA_REQUEST request = {};
-	request.requestedFormatId = format;
-	const UINT status = cliprdr->ClientFormatDataRequest(cliprdr, &request);
-	if (status != CHANNEL_RC_OK) {
-		m->requested_clipboard_format = 0;
-	}
+	// 他のウィンドウのセッションは、このQMimeDataを通してこのセッションのサーバーから取り寄せる
+	auto *mime = new RemoteMimeData(RemoteClipboardOffer{m->remote_clipboard, generation, has_text, has_dib, png_format});
+	auto *clipboard = QApplication::clipboard();
+	clipboard->clear(QClipboard::Clipboard);
+	clipboard->setMimeData(mime, QClipboard::Clipboard);
 }
 
 UINT MainWindow::cliprdrServerFormatDataRequest(CliprdrClientContext *cliprdr, const CLIPRDR_FORMAT_DATA_REQUEST *request)
 {
 	if (!cliprdr->ClientFormatDataResponse) return CHANNEL_RC_OK;
 
-	QString text;
-	QImage image;
+	const UINT32 format = request->requestedFormatId;
 	auto *self = static_cast<MainWindow *>(cliprdr->custom);
+	std::shared_ptr<const LocalClipboardSnapshot> snapshot;
 	if (self) {
-		auto readClipboard = [self, &text, &image]() {
-			text = self->m->local_clipboard_text;
-			image = self->m->local_clipboard_image;
-		};
-		if (QThread::currentThread() == self->thread()) {
-			readClipboard();
-		} else {
-			QMetaObject::invokeMethod(self, readClipboard, Qt::BlockingQueuedConnection);
-		}
+		snapshot = LocalClipboard::instance()->snapshot();
+		// 提示した後にこのセッションのサーバーの内容へ変わっていたら、自分から取り寄せることになるので答えない
+		if (snapshot && snapshot->isFrom(self->m->remote_clipboard.get())) snapshot.reset();
 	}
 
-	QByteArray encoded;
-	CLIPRDR_FORMAT_DATA_RESPONSE response = {};
-	if (request->requestedFormatId == CF_UNICODETEXT) {
-		encoded.resize((text.size() + 1) * 2);
-		auto *dst = reinterpret_cast<uchar *>(encoded.data());
-		for (qsizetype i = 0; i < text.size(); ++i) {
-			qToLittleEndian<quint16>(text.utf16()[i], dst + i * 2);
+	std::optional<LocalClipboardFormat> kind;
+	if (snapshot) {
+		if (format == CF_UNICODETEXT && snapshot->hasText()) {
+			kind = LocalClipboardFormat::UnicodeText;
+		} else if (format == CF_DIB && snapshot->hasImage()) {
+			kind = LocalClipboardFormat::Dib;
+		} else if (format == CLIENT_PNG_FORMAT_ID && snapshot->hasImage()) {
+			kind = LocalClipboardFormat::Png;
 		}
-		qToLittleEndian<quint16>(0, dst + text.size() * 2);
-		response.common.msgFlags = CB_RESPONSE_OK;
-		response.common.dataLen = encoded.size();
-		response.requestedFormatData = reinterpret_cast<const BYTE *>(encoded.constData());
-	} else if (request->requestedFormatId == CF_DIB) {
-		encoded = imageToDib(image);
-		if (!encoded.isEmpty()) {
-			response.common.msgFlags = CB_RESPONSE_OK;
-			response.common.dataLen = encoded.size();
-			response.requestedFormatData = reinterpret_cast<const BYTE *>(encoded.constData());
-		} else {
-			response.common.msgFlags = CB_RESPONSE_FAIL;
-		}
-	} else {
-		response.common.msgFlags = CB_RESPONSE_FAIL;
 	}
-	return cliprdr->ClientFormatDataResponse(cliprdr, &response);
+	if (!kind) return RemoteClipboard::sendResponse(cliprdr, {});
+
+	// スナップショットに持っているローカルのテキストだけはすぐに答える
+	if (*kind == LocalClipboardFormat::UnicodeText && !snapshot->isRelay()) {
+		return RemoteClipboard::sendResponse(cliprdr, snapshot->unicodeText());
+	}
+
+	// 中継の取り寄せ、画像の取り出し(GUIスレッド)と変換はこのスレッドを止めずに行い、
+	// できあがったら変換用のスレッドから答える
+	std::shared_ptr<RemoteClipboard> clipboard = self->m->remote_clipboard;
+	const quint64 channel = clipboard->channel();
+	LocalClipboard::instance()->encode(snapshot, *kind, [clipboard, channel](QByteArray encoded) {
+		clipboard->respond(channel, encoded);
+	});
+	return CHANNEL_RC_OK;
 }
 
 UINT MainWindow::cliprdrServerFormatDataResponse(CliprdrClientContext *cliprdr, const CLIPRDR_FORMAT_DATA_RESPONSE *response)
 {
 	auto *self = static_cast<MainWindow *>(cliprdr->custom);
-	const UINT32 requestedFormat = self ? self->m->requested_clipboard_format.exchange(0) : 0;
-	if (!self || (requestedFormat != CF_UNICODETEXT && requestedFormat != CF_DIB)) {
-		return CHANNEL_RC_OK;
-	}
-	if (response->common.msgFlags & CB_RESPONSE_FAIL) {
-		const quint64 generation = self->m->remote_clipboard_generation;
-		QMetaObject::invokeMethod(self, [self, cliprdr, generation, requestedFormat]() {
-			if (self->m->cliprdr != cliprdr || self->m->remote_clipboard_generation != generation)
-				return;
-			const int delay = 50 * self->m->remote_clipboard_request_attempts;
-			QTimer::singleShot(delay, self, [self, cliprdr, generation, requestedFormat]() {
-				self->requestRemoteClipboardData(cliprdr, generation, requestedFormat);
-			});
-		}, Qt::QueuedConnection);
-		return CHANNEL_RC_OK;
-	}
-	QByteArray data(reinterpret_cast<const char *>(response->requestedFormatData), response->common.dataLen);
-	QMetaObject::invokeMethod(self, [self, data, requestedFormat]() {
-		if (requestedFormat == CF_DIB)
-			self->setClipboardImageFromRdp(data);
-		else
-			self->setClipboardTextFromRdp(data);
-	}, Qt::QueuedConnection);
+	if (self) {
+		const bool ok = !(response->common.msgFlags & CB_RESPONSE_FAIL);
+		self->m->remote_clipboard->deliver(ok, response->requestedFormatData, response->common.dataLen);
+	}
 	return CHANNEL_RC_OK;
 }
 
-void MainWindow::setClipboardTextFromRdp(const QByteArray &data)
+UINT MainWindow::onDisplayControlCaps(DispClientContext *disp, UINT32 maxNumMonitors, UINT32 maxMonitorAreaFactorA, UINT32 maxMonitorAreaFactorB)
 {
-	const qsizetype units = data.size() / 2;
-	QString text;
-	text.reserve(units);
-	const auto *src = reinterpret_cast<const uchar *>(data.constData());
-	for (qsizetype i = 0; i < units; ++i) {
-		const quint16 ch = qFromLittleEndian<quint16>(src + i * 2);
-		if (ch == 0) break;
-		text.append(QChar(ch));
-	}
-	auto *mime = new QMimeData;
-	mime->setText(text);
-	mime->setData(REMOTE_CLIPBOARD_MIME, QByteArrayLiteral("1"));
-	auto *clipboard = QApplication::clipboard();
-	m->updating_remote_clipboard = true;
-	clipboard->clear(QClipboard::Clipboard);
-	clipboard->setMimeData(mime, QClipboard::Clipboard);
-	m->updating_remote_clipboard = false;
+	return CHANNEL_RC_OK;
 }
 
-void MainWindow::setClipboardImageFromRdp(const QByteArray &data)
+void MainWindow::on_action_view_statistics_toggled(bool checked)
 {
-	QImage image = dibToImage(data);
-	if (image.isNull()) return;
-	auto *mime = new QMimeData;
-	mime->setImageData(image);
-	mime->setData(REMOTE_CLIPBOARD_MIME, QByteArrayLiteral("1"));
-	auto *clipboard = QApplication::clipboard();
-	m->updating_remote_clipboard = true;
-	clipboard->clear(QClipboard::Clipboard);
-	clipboard->setMimeData(mime, QClipboard::Clipboard);
-	m->updating_remote_clipboard = false;
+	ui->widget_view->setStatisticsOverlayVisible(checked);
 }
 
-UINT MainWindow::onDisplayControlCaps(DispClientContext *disp, UINT32 maxNumMonitors, UINT32 maxMonitorAreaFactorA, UINT32 maxMonitorAreaFactorB)
+void MainWindow::on_action_view_save_statistics_triggered()
 {
-	return CHANNEL_RC_OK;
+	QString path = ui->widget_view->saveFrameStatistics(global->app_config_dir);
+	if (path.isEmpty()) {
+		statusBar()->showMessage(tr("Failed to save frame statistics"));
+	} else {
+		statusBar()->showMessage(tr("Frame statistics saved to %1").arg(path));
+	}
+}
+
+void MainWindow::on_action_view_record_frames_toggled(bool checked)
+{
+	if (!checked) {
+		m->frame_recorder.stop();
+		statusBar()->showMessage(tr("Frame recording stopped"));
+		return;
+	}
+	QDir().mkpath(global->app_config_dir);
+	const QString path = global->app_config_dir / "frames_" + QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss") + ".rfr";
+	if (m->frame_recorder.start(path)) {
+		statusBar()->showMessage(tr("Recording frames to %1").arg(path));
+	} else {
+		statusBar()->showMessage(tr("Failed to open %1").arg(path));
+		QSignalBlocker block(ui->action_view_record_frames);
+		ui->action_view_record_frames->setChecked(false);
+	}
 }
 
 void MainWindow::on_action_full_screen_triggered()
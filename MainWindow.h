@@ -1,6 +1,8 @@
 #ifndef MAINWINDOW_H
 #define MAINWINDOW_H
 
+#include "ConnectionDialog.h"
+#include "NetworkProfile.h"
 #include <QDebug>
 #include <QImage>
 #include <QInputDialog>
@@ -11,11 +13,16 @@
 #include <freerdp/client/cmdline.h>
 #include <freerdp/freerdp.h>
 #include <freerdp/gdi/gdi.h>
+#include <freerdp/graphics.h>
 #include <freerdp/primary.h>
+#include <functional>
 #include <thread>
+#include <vector>
 #include <freerdp/freerdp.h>
 #include <freerdp/client/disp.h>
 #include <freerdp/client/cliprdr.h>
+#include <freerdp/autodetect.h>
+#include <freerdp/client/rdpgfx.h>
 
 QT_BEGIN_NAMESPACE
 namespace Ui {
@@ -28,6 +35,19 @@ enum RdpSessionVersion {
 	V2,
 };
 
+// 接続の状態。接続と切断はRDPスレッドで行い、状態は原子的に書き換える。
+// FreeRDPが呼び出しを返さない段階(信頼済みの証明書など)は飛ばされることがある。
+enum class ConnectionState {
+	Disconnected,
+	Resolving,	  // 名前解決とTCP接続
+	Tls,		  // TLSのハンドシェイクと証明書の確認
+	Auth,		  // 認証(NLA)
+	Capabilities, // 能力の交換と初期化
+	Active,
+	Reconnecting, // ネットワークが切れたので自動で再接続している
+	Closing,
+};
+
 class MainWindow : public QMainWindow {
 	Q_OBJECT
 	friend class CommandForm;
@@ -44,10 +64,39 @@ private:
 	static BOOL rdp_authenticate(freerdp *instance, char **username, char **password, char **domain);
 	static BOOL rdp_end_paint(rdpContext *context);
 	static BOOL rdp_resize_display(rdpContext *context);
+	static BOOL rdp_pointer_new(rdpContext *context, rdpPointer *pointer);
+	static void rdp_pointer_free(rdpContext *context, rdpPointer *pointer);
+	static BOOL rdp_pointer_set(rdpContext *context, rdpPointer *pointer);
+	static BOOL rdp_pointer_set_null(rdpContext *context);
+	static BOOL rdp_pointer_set_default(rdpContext *context);
+	static BOOL rdp_pointer_set_position(rdpContext *context, UINT32 x, UINT32 y);
+	static BOOL rdp_network_characteristics_result(rdpAutoDetect *autodetect, RDP_TRANSPORT_TYPE transport, UINT16 sequenceNumber, const rdpNetworkCharacteristicsResult *result);
+	void onNetworkCharacteristics(rdpNetworkCharacteristicsResult const &result);
+	void postNetworkStatus();
+	void showNetworkStatus(NetworkMeasurement const &network, NetworkProfile profile, NetworkProfile next);
+	static BOOL rdp_send_channel_data(freerdp *instance, UINT16 channelId, const BYTE *data, size_t size);
+	static BOOL rdp_receive_channel_data(freerdp *instance, UINT16 channelId, const BYTE *data, size_t size, UINT32 flags, size_t totalSize);
+	static UINT rdpgfx_surface_command(RdpgfxClientContext *gfx, const RDPGFX_SURFACE_COMMAND *cmd);
+	void updateSessionStats();
+	void writeSessionStatsLog();
 
-	void doConnect(const QString &hostname, const QString &username, const QString &password, const QString &domain);
+	void setPixelFormat(PixelFormat format);
+	void doConnect(const QString &hostname, const QString &username, const QString &password, const QString &domain, const ConnectionOptions &options);
 	BOOL onRdpPostConnect(freerdp *instance);
-	void start_rdp_thread();
+	void start_rdp_thread(quint64 session_id, const QString &hostname);
+	void runRdpThread(quint64 session_id, const QString &hostname);
+	void processRdpEvents(freerdp *instance);
+	bool reconnect(freerdp *instance);
+	void setConnectionState(ConnectionState state);
+	void showConnectionState();
+	DWORD callOnGuiThread(std::function<DWORD()> const &fn, DWORD fallback);
+	bool isConnected() const;
+	void finishDisconnect(quint64 session_id);
+	void waitForDisconnect();
+	void wakeupRdpThread();
+	void processRdpThreadRequests();
+	void flushDamage();
+	void applyDesktopSize(const QSize &size);
 	void resizeDynamic();
 	void resizeDynamicLater();
 	static void channelConnected(void *context, const ChannelConnectedEventArgs *e);
@@ -57,10 +106,7 @@ private:
 	static UINT cliprdrServerFormatDataRequest(CliprdrClientContext *cliprdr, const CLIPRDR_FORMAT_DATA_REQUEST *request);
 	static UINT cliprdrServerFormatDataResponse(CliprdrClientContext *cliprdr, const CLIPRDR_FORMAT_DATA_RESPONSE *response);
 	void sendClipboardFormatList();
-	void beginRemoteClipboardRequest(CliprdrClientContext *cliprdr, UINT32 format);
-	void requestRemoteClipboardData(CliprdrClientContext *cliprdr, quint64 generation, UINT32 format);
-	void setClipboardTextFromRdp(const QByteArray &data);
-	void setClipboardImageFromRdp(const QByteArray &data);
+	void setRemoteClipboard(quint64 generation, bool has_text, bool has_dib, UINT32 png_format);
 	rdpContext *rdp_context();
 	freerdp *rdp_instance();
 	s_disp_client_context *disp_client_context();
@@ -79,8 +125,9 @@ private:
 	static void clientContextFree(freerdp *instance, rdpContext *context);
 	static int clientContextStart(rdpContext *context);
 	static int clientContextStop(rdpContext *context);
-	void initInstance(freerdp *instance);
+	static void initInstance(freerdp *instance);
 	void setupRdpContext(rdpContext *rdpcx);
+	void registerPointer(rdpContext *rdpcx);
 protected:
 	void closeEvent(QCloseEvent *event);
 public:
@@ -89,10 +136,11 @@ public:
 	RdpSessionVersion rdp_session_version();
 private slots:
 	void doDisconnect();
+	void on_action_new_window_triggered();
 	void on_action_connect_triggered();
 	void on_action_disconnect_triggered();
 	void updateScreen();
-	void updateScreen2(const QImage &image, const QRect &rect);
+	void updateScreen2(const QImage &image, const std::vector<QRect> &rects, qint64 end_paint_time);
 	void on_action_view_dynamic_resolution_toggled(bool arg1);
 
 signals:
@@ -104,9 +152,13 @@ public:
 
 	bool isDynamicResizingEnabled() const;
 	void setFullScreen(bool full_screen);
+	void setViewScale(int scale);
 	void showCommandForm(bool show);
 private slots:
 	void onIntervalTimer();
+	void on_action_view_statistics_toggled(bool checked);
+	void on_action_view_save_statistics_triggered();
+	void on_action_view_record_frames_toggled(bool checked);
 	void on_action_full_screen_triggered();
 	void on_action_exit_full_screen_triggered();
 protected:
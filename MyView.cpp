@@ -1,19 +1,38 @@
 
 #include "MyView.h"
 #include "CommandForm.h"
-#include "Global.h"
-#include "MainWindow.h"
+#include "FrameRing.h"
+#include "FrameStats.h"
+#include "ImageScaler.h"
+#include "InputQueue.h"
+#include "joinpath.h"
 #include <QApplication>
+#include <QDateTime>
+#include <QDebug>
+#include <QDir>
+#include <QCursor>
+#include <QElapsedTimer>
+#include <QFile>
+#include <QHash>
+#include <QJsonDocument>
+#include <QJsonObject>
 #include <QPainter>
-#include <QPainterPath>
+#include <QPaintEvent>
+#include <QScreen>
 #include <QTimer>
 #include <QWheelEvent>
+#include <algorithm>
+#include <atomic>
 #include <condition_variable>
 #include <deque>
 #include <freerdp/scancode.h>
 #include <mutex>
 #include <thread>
 
+static constexpr int MOUSE_MOVE_INTERVAL_MS = 4; // 250Hzを上限に送る
+static constexpr qint64 INPUT_PROBE_TIMEOUT_NS = 2000000000; // これより遅い応答は入力によるものとみなさない
+static constexpr size_t RECENT_INPUT_LATENCY_COUNT = 100;
+
 struct MyView::Private {
 	CommandForm *command_form = nullptr;
 
@@ -26,12 +45,39 @@ struct MyView::Private {
 
 	QSize frame_size;
 
-	QRect update_rect;
-	QImage next_input_frame;
-	QImage next_output_frame;
-	QImage painting_image;
-
-	int scale = 1;
+	FrameRing ring;
+	bool published = false; // ringに新しいフレームが公開された(ワーカーへの通知)
+	DamageRegion published_damage; // 公開済みでまだGUIへ通知していない差分
+	DamageRegion scaled_damage; // 公開済みでまだscaled_imageへ反映していない差分
+	qint64 scaled_damage_time = 0; // scaled_damageのうち最も新しいEndPaintの時刻
+	QImage scaled_image; // 表示倍率が2倍以上のときの拡大済みの画面(GUIスレッド専用)
+	QSize layout_frame_size; // 最後にlayoutViewしたときのフレームサイズ
+
+	std::atomic<quint64> copied_bytes { 0 };
+	quint64 copied_bytes_per_second = 0;
+
+	// フレームが各段階を通過した時刻。まとめて表示されるフレームは最も古いものを代表にする。
+	struct FrameTimes {
+		qint64 end_paint = 0;
+		qint64 copied = 0;
+		qint64 composed = 0;
+	};
+	FrameTimes published_times; // ワーカーへ渡す(mutexで保護)
+	FrameTimes presenting_times; // paintEventへ渡す(mutexで保護)
+	FrameStats frame_stats;
+	bool overlay_visible = false;
+	QStringList overlay_lines;
+	QStringList session_lines; // MainWindowが1秒ごとに渡すセッションの統計
+	bool dimmed = false; // 再接続を待っている間は最後のフレームを暗くして表示する
+
+	// 表示の間隔の制御。届いた差分はpresent_regionにまとめておき、
+	// ディスプレイのリフレッシュ間隔(またはmax_fps)に1回だけ描画を要求する。
+	QRegion present_region;
+	QTimer present_timer;
+	QElapsedTimer last_present;
+	int max_fps = 0; // 0: ディスプレイのリフレッシュレートに合わせる、負: 制限しない
+
+	std::atomic<int> scale { 1 };
 	int offset_x = 0;
 	int offset_y = 0;
 
@@ -39,8 +85,40 @@ struct MyView::Private {
 	int frame_count = 0;
 	int fps = 0;
 
-	QTimer key_event_timer;
-	std::deque<std::vector<Key>> key_event_queue;
+	// マウス移動の間引き。移動はmove_posに最新の位置だけを残し、
+	// MOUSE_MOVE_INTERVAL_MSごとにまとめて1回だけ送る。ボタン・ホイール・キーを
+	// 送る前には必ず溜まっている移動を先に送り、順序を保つ。
+	bool move_pending = false;
+	QPoint move_pos;
+	QTimer move_timer;
+	QElapsedTimer last_move_sent;
+	int moves_sent = 0; // 1秒あたり
+	int moves_coalesced = 0; // 1秒あたり
+	int moves_sent_per_second = 0;
+	int input_pdus_per_second = 0;
+	int moves_coalesced_per_second = 0;
+
+	// クリック(キー入力)から、その近くの画面の変化が描画されるまでの遅延の計測。
+	// 計測中は次の入力で上書きせず、最初の入力への応答を待つ。
+	qint64 probe_time = 0; // 計測中の入力の時刻(0: 計測していない)
+	QRect probe_rect; // RDP座標。この範囲にかかる差分を応答とみなす(空なら画面全体)
+	int probe_radius = 64;
+	QPoint last_pointer_pos; // RDP座標
+	LatencyHistogram input_latency;
+	std::deque<qint64> recent_input_latency; // 状態バーに出す直近の値(ナノ秒)
+
+	// サーバーから届いたポインタの形状。形状ごとに一度だけQCursorへ変換して使い回すので、
+	// カーソルの移動はローカルのウィンドウシステムが描き、ネットワークも画面の差分も介さない。
+	struct RemoteCursor {
+		QImage image;
+		QPoint hotspot;
+		QCursor cursor; // 表示倍率を掛けたもの(未作成ならpixmapが空)
+	};
+	QHash<quint64, RemoteCursor> remote_cursors;
+	quint64 current_cursor = 0; // 0: サーバーの形状を使っていない
+
+	// キーとマウスの入力はここへ積み、RDPスレッドがネットワークの処理と同じループで送る
+	InputQueue input_queue;
 };
 
 MyView::MyView(QWidget *parent)
@@ -52,24 +130,41 @@ MyView::MyView(QWidget *parent)
 
 	setFocusPolicy(Qt::StrongFocus);
 	setMouseTracking(true);
+	// 背景はpaintEventで自前で描くので、部分更新のたびに消去させない
+	setAttribute(Qt::WA_OpaquePaintEvent);
 
 	connect(this, &MyView::ready, this, &MyView::kickUpdate);
 	startThread();
 
+	m->present_timer.setSingleShot(true);
+	m->present_timer.setTimerType(Qt::PreciseTimer);
+	connect(&m->present_timer, &QTimer::timeout, this, &MyView::present);
+
 	connect(&m->fps_timer, &QTimer::timeout, this, [this]() {
 		m->fps = m->frame_count;
 		m->frame_count = 0;
-		update();
+		m->copied_bytes_per_second = m->copied_bytes.exchange(0);
+		// RDPスレッドが送る直前に間引いた分も数える
+		const int drained = m->input_queue.coalesced_moves.exchange(0);
+		m->moves_sent_per_second = m->moves_sent - drained;
+		m->input_pdus_per_second = m->input_queue.sent_pdus.exchange(0);
+		m->moves_coalesced_per_second = m->moves_coalesced + drained;
+		m->moves_sent = 0;
+		m->moves_coalesced = 0;
+		if (m->overlay_visible) {
+			updateOverlayText();
+			update(overlayRect());
+		}
 	});
 	m->fps_timer.start(1000); // 1秒ごとにFPSを更新
 
-	connect(&m->key_event_timer, &QTimer::timeout, this, &MyView::sendKeyChunk);
-	m->key_event_timer.start(1);
+	m->move_timer.setSingleShot(true);
+	m->move_timer.setTimerType(Qt::PreciseTimer);
+	connect(&m->move_timer, &QTimer::timeout, this, &MyView::flushMouseMove);
 }
 
 MyView::~MyView()
 {
-	m->key_event_timer.stop();
 	stopThread();
 	delete m;
 }
@@ -79,7 +174,8 @@ void MyView::startThread()
 	m->interrupted = false;
 	m->thread = std::thread([this]() {
 		while (true) {
-			QImage next_input_frame;
+			DamageRegion damage;
+			Private::FrameTimes times;
 			{
 				std::unique_lock<std::mutex> lock(m->mutex);
 				// 述語付きwaitにすることで、notify_all()がこのスレッドが
@@ -87,36 +183,32 @@ void MyView::startThread()
 				// (述語なしのwait()だと、stopThread()側のinterrupted=trueとnotify_all()が
 				// このスレッドのwait呼び出し前に完了した場合、通知を取り逃して
 				// 二度と起床できずthread.join()が永久に返らなくなる)
-				m->cv.wait(lock, [this] { return m->interrupted || !m->next_input_frame.isNull(); });
+				m->cv.wait(lock, [this] { return m->interrupted || m->published; });
 				if (m->interrupted) break;
-				std::swap(next_input_frame, m->next_input_frame);
+				m->published = false;
+				damage = m->published_damage;
+				m->published_damage.clear();
+				std::swap(times, m->published_times);
 			}
-			// if (!m->rdp_instance) continue;
-			// if (!m->rdp_instance->context) continue;
-			if (next_input_frame.isNull()) continue;
-			QRect update_rect;
-			{
+			if (times.end_paint != 0) {
+				times.composed = FrameStats::now();
+				m->frame_stats.record(FrameStats::Compose, times.composed - times.copied);
 				std::lock_guard lock(m->mutex);
-				update_rect = m->update_rect;
-				if (update_rect.isNull() || m->next_output_frame.size() != next_input_frame.size()) {
-					m->next_output_frame = QImage(next_input_frame.width(), next_input_frame.height(), next_input_frame.format());
-					update_rect = next_input_frame.rect();
-					if (global->mainwindow->rdp_session_version() == RdpSessionVersion::V2) {
-						// experimental: V2のときは、間接描画しなくても大丈夫そう
-						m->painting_image = m->next_output_frame;
-						emit ready();
-					}
+				if (m->presenting_times.end_paint == 0) {
+					m->presenting_times = times;
 				}
 			}
-			{
-				QPainter pr(&m->next_output_frame);
-				pr.drawImage(update_rect, next_input_frame, update_rect);
-			}
-			{
-				std::lock_guard lock(m->mutex);
-				m->painting_image = m->next_output_frame.copy();
+			// フレームはRDPスレッドがringへ書き込み済みなので、ここでは
+			// 表示倍率を掛けた差分領域をGUIへ知らせるだけ
+			const int scale = m->scale;
+			QRect rects[DamageRegion::MAX_RECTS];
+			int n = 0;
+			for (QRect const &r : damage) {
+				rects[n++] = QRect(r.x() * scale, r.y() * scale, r.width() * scale, r.height() * scale);
 			}
-			emit ready();
+			QRegion region;
+			region.setRects(rects, n);
+			emit ready(region);
 		}
 	});
 }
@@ -147,25 +239,103 @@ QPoint MyView::mapToRdp(const QPoint &pos) const
 	return QPoint((pos.x() + m->offset_x) / m->scale, (pos.y() + m->offset_y) / m->scale);
 }
 
-void MyView::kickUpdate()
+void MyView::kickUpdate(const QRegion &region)
 {
-	update();
+	m->present_region += region;
+	schedulePresent();
+}
+
+void MyView::setMaxFps(int fps)
+{
+	m->max_fps = fps;
+}
+
+// 1フレームあたりの表示間隔
+qint64 MyView::presentIntervalNsecs() const
+{
+	if (m->max_fps < 0) return 0; // 間隔を空けずに表示する(再生ベンチマーク用)
+	qreal hz = screen() ? screen()->refreshRate() : 0;
+	if (hz <= 0) hz = 60;
+	if (m->max_fps > 0 && m->max_fps < hz) hz = m->max_fps;
+	return qint64(1000000000 / hz);
+}
+
+void MyView::schedulePresent()
+{
+	if (m->present_timer.isActive()) return; // 次の表示に合流させる
+
+	const qint64 interval = presentIntervalNsecs();
+	const qint64 elapsed = m->last_present.isValid() ? m->last_present.nsecsElapsed() : interval;
+	if (elapsed >= interval) {
+		present();
+	} else {
+		m->present_timer.start(int((interval - elapsed + 999999) / 1000000));
+	}
+}
+
+void MyView::present()
+{
+	m->last_present.start();
+
+	QSize frame_size;
+	{
+		std::lock_guard lock(m->mutex);
+		frame_size = m->frame_size;
+	}
+	if (frame_size != m->layout_frame_size) {
+		// フレームサイズが変わったときは枠の位置も変わるので全体を描き直す
+		layoutView(true);
+	} else if (!m->present_region.isEmpty()) {
+		update(m->present_region.translated(-m->offset_x, -m->offset_y));
+	}
+	m->present_region = QRegion();
+	emit presented();
 }
 
 void MyView::setImage(const QImage &image, QRect const &rect)
 {
+	DamageRegion damage;
+	damage.add(rect.isNull() ? image.rect() : rect);
+	publishFrame(image, damage, FrameStats::now());
+}
+
+// 画面の変化した矩形だけを、三面バッファのうち書き込み側のバッファへコピーして公開する。
+// そのバッファが前回使われてから後に他のバッファへ反映された差分も、ここでまとめて追いつく。
+void MyView::setDamage(const QImage &screen, const std::vector<QRect> &rects, qint64 end_paint_time)
+{
+	DamageRegion damage;
+	for (QRect const &r : rects) {
+		damage.add(r);
+	}
+	publishFrame(screen, damage, end_paint_time);
+}
+
+void MyView::publishFrame(const QImage &screen, const DamageRegion &damage, qint64 end_paint_time)
+{
+	if (screen.isNull()) return;
+	m->copied_bytes += m->ring.write(screen, damage);
+	const qint64 copied = FrameStats::now();
+	m->frame_stats.record(FrameStats::Copy, copied - end_paint_time);
 	{
 		std::lock_guard lock(m->mutex);
-		m->frame_size = image.size();
-		m->next_input_frame = image;
-		m->update_rect = rect;
+		if (m->published_times.end_paint == 0) {
+			m->published_times = {end_paint_time, copied, 0};
+		}
+		m->frame_size = screen.size();
+		m->published = true;
+		m->published_damage.add(damage);
+		m->scaled_damage.add(damage);
+		m->scaled_damage_time = std::max(m->scaled_damage_time, end_paint_time);
 	}
 	m->cv.notify_all(); // スレッドを起床させる
-	layoutView(false);
 }
 
 void MyView::layoutView(bool update_view)
 {
+	{
+		std::lock_guard lock(m->mutex);
+		m->layout_frame_size = m->frame_size;
+	}
 	int w = m->frame_size.width() * m->scale;
 	int h = m->frame_size.height() * m->scale;
 	int x = (w > width()) ? 0 : (width() - w) / 2;
@@ -190,7 +360,59 @@ bool MyView::isCommandFormVisible() const
 
 void MyView::setRdpInstance(freerdp *instance)
 {
+	m->move_timer.stop();
+	m->move_pending = false;
 	m->rdp_instance = instance;
+	m->remote_cursors.clear();
+	m->current_cursor = 0;
+	unsetCursor();
+}
+
+// RDPスレッドがポインタを登録したときに呼ばれる
+void MyView::addRemoteCursor(quint64 id, QImage const &image, QPoint const &hotspot)
+{
+	m->remote_cursors.insert(id, {image, hotspot, QCursor()});
+}
+
+void MyView::removeRemoteCursor(quint64 id)
+{
+	m->remote_cursors.remove(id);
+	if (m->current_cursor == id) {
+		m->current_cursor = 0;
+	}
+}
+
+void MyView::setRemoteCursor(quint64 id)
+{
+	auto it = m->remote_cursors.find(id);
+	if (it == m->remote_cursors.end()) return;
+	if (it->cursor.pixmap().isNull()) {
+		const int scale = m->scale;
+		QPixmap pixmap = QPixmap::fromImage(scale > 1 ? it->image.scaled(it->image.size() * scale) : it->image);
+		it->cursor = QCursor(pixmap, it->hotspot.x() * scale, it->hotspot.y() * scale);
+	}
+	m->current_cursor = id;
+	setCursor(it->cursor);
+}
+
+void MyView::setRemoteCursorHidden()
+{
+	m->current_cursor = 0;
+	setCursor(Qt::BlankCursor);
+}
+
+void MyView::setRemoteCursorDefault()
+{
+	m->current_cursor = 0;
+	unsetCursor();
+}
+
+// サーバーがポインタを動かしたとき(RDP座標)
+void MyView::moveRemoteCursor(QPoint const &pos)
+{
+	if (!isActiveWindow() || !underMouse()) return;
+	const int scale = m->scale;
+	QCursor::setPos(mapToGlobal(QPoint(pos.x() * scale - m->offset_x, pos.y() * scale - m->offset_y)));
 }
 
 int MyView::scale() const
@@ -201,37 +423,231 @@ int MyView::scale() const
 void MyView::setScale(int scale)
 {
 	m->scale = scale;
+	m->scaled_image = {}; // 次のpaintEventで作り直す
+	for (auto &c : m->remote_cursors) {
+		c.cursor = QCursor(); // カーソルも新しい倍率で作り直す
+	}
+	if (m->current_cursor != 0) {
+		setRemoteCursor(m->current_cursor);
+	}
 	layoutView(true);
 }
 
+QRect MyView::overlayRect() const
+{
+	const int line_height = QFontMetrics(overlayFont()).height();
+	return {8, 8, 440, line_height * (int)m->overlay_lines.size() + 12};
+}
+
+QFont MyView::overlayFont() const
+{
+	QFont font("Monospace", 9);
+	font.setStyleHint(QFont::TypeWriter);
+	return font;
+}
+
+void MyView::updateOverlayText()
+{
+	auto ms = [](qint64 usecs) { return QString::number(usecs / 1000.0, 'f', 2); };
+	QStringList lines;
+	lines.append(QString("FPS: %1  Copy: %2 KB/s").arg(m->fps).arg(m->copied_bytes_per_second / 1024));
+	lines.append(QString("Mouse moves: %1/s sent, %2/s coalesced").arg(m->moves_sent_per_second).arg(m->moves_coalesced_per_second));
+	lines.append(QString("Input PDUs: %1/s").arg(m->input_pdus_per_second));
+	if (const quint64 n = m->frame_stats.reconnect.count()) {
+		auto const &h = m->frame_stats.reconnect;
+		lines.append(QString("Reconnects: %1  p50 %2 ms  p95 %3 ms").arg(n).arg(ms(h.percentile(0.50))).arg(ms(h.percentile(0.95))));
+	}
+	lines.append(QString("%1 %2 %3 %4 (ms)").arg("stage", -8).arg("p50", 8).arg("p95", 8).arg("p99", 8));
+	for (int i = 0; i < FrameStats::StageCount; i++) {
+		auto const &h = m->frame_stats.stages[i];
+		lines.append(QString("%1 %2 %3 %4")
+						 .arg(FrameStats::stageName(FrameStats::Stage(i)), -8)
+						 .arg(ms(h.percentile(0.50)), 8)
+						 .arg(ms(h.percentile(0.95)), 8)
+						 .arg(ms(h.percentile(0.99)), 8));
+	}
+	lines.append(m->session_lines);
+	m->overlay_lines = lines;
+}
+
+void MyView::drawOverlay(QPainter *painter)
+{
+	const QRect r = overlayRect();
+	painter->save();
+	painter->fillRect(r, QColor(0, 0, 0, 160));
+	painter->setPen(Qt::white);
+	painter->setFont(overlayFont());
+	const int line_height = painter->fontMetrics().height();
+	int y = r.y() + 6 + painter->fontMetrics().ascent();
+	for (QString const &line : m->overlay_lines) {
+		painter->drawText(r.x() + 6, y, line);
+		y += line_height;
+	}
+	painter->restore();
+}
+
+bool MyView::isStatisticsOverlayVisible() const
+{
+	return m->overlay_visible;
+}
+
+void MyView::setStatisticsOverlayVisible(bool visible)
+{
+	if (m->overlay_visible) {
+		update(overlayRect());
+	}
+	m->overlay_visible = visible;
+	if (visible) {
+		updateOverlayText();
+		update(overlayRect());
+	}
+}
+
+// 通信量やコーデックなど、セッションの統計をオーバーレイの下に並べる
+void MyView::setSessionStatistics(const QStringList &lines)
+{
+	if (m->session_lines == lines) return;
+	const QRect old_rect = overlayRect();
+	m->session_lines = lines;
+	if (m->overlay_visible) {
+		updateOverlayText();
+		update(old_rect | overlayRect()); // 行が減ったときは元の範囲も描き直す
+	}
+}
+
+// 各段階の遅延のヒストグラムをJSONとCSVで書き出す。書き出したJSONのパスを返す。
+QString MyView::saveFrameStatistics(QString const &dir) const
+{
+	QDir().mkpath(dir);
+	const QString base = "frame_stats_" + QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss");
+	const QString json_path = dir / base + ".json";
+	const QString csv_path = dir / base + ".csv";
+	if (!m->frame_stats.save(json_path, csv_path)) return {};
+	return json_path;
+}
+
+// どのスレッドから呼んでもよい
+void MyView::recordReconnect(qint64 nsecs)
+{
+	m->frame_stats.reconnect.record(nsecs);
+}
+
+void MyView::setDimmed(bool dimmed)
+{
+	if (m->dimmed == dimmed) return;
+	m->dimmed = dimmed;
+	update();
+}
+
+void MyView::setInputLatencyProbeRadius(int radius)
+{
+	m->probe_radius = std::max(radius, 0);
+}
+
+// 入力の時刻を記録し、ポインタの周りの変化を待つ
+void MyView::startInputProbe()
+{
+	const qint64 now = FrameStats::now();
+	if (m->probe_time != 0 && now - m->probe_time < INPUT_PROBE_TIMEOUT_NS) return;
+	m->probe_time = now;
+	const int r = m->probe_radius;
+	m->probe_rect = r > 0 ? QRect(m->last_pointer_pos - QPoint(r, r), QSize(2 * r + 1, 2 * r + 1)) : QRect();
+}
+
+void MyView::recordInputLatency(qint64 nsecs)
+{
+	m->input_latency.record(nsecs);
+	m->recent_input_latency.push_back(nsecs);
+	if (m->recent_input_latency.size() > RECENT_INPUT_LATENCY_COUNT) {
+		m->recent_input_latency.pop_front();
+	}
+	std::vector<qint64> v(m->recent_input_latency.begin(), m->recent_input_latency.end());
+	std::sort(v.begin(), v.end());
+	const qint64 p50 = v[(v.size() - 1) * 50 / 100];
+	const qint64 p95 = v[(v.size() - 1) * 95 / 100];
+	emit inputLatencyChanged(p50 / 1000, p95 / 1000);
+}
+
+// 入力遅延のヒストグラムをJSONで書き出して計測をやり直す。書き出したパスを返す(計測がなければ空)。
+QString MyView::saveInputLatency(QString const &dir)
+{
+	m->probe_time = 0;
+	if (m->input_latency.count() == 0) return {};
+	QDir().mkpath(dir);
+	const QString path = dir / "input_latency_" + QDateTime::currentDateTime().toString("yyyyMMdd_HHmmss") + ".json";
+	QFile file(path);
+	if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate)) return {};
+	file.write(QJsonDocument(m->input_latency.toJson()).toJson());
+	m->input_latency.reset();
+	m->recent_input_latency.clear();
+	return path;
+}
+
 void MyView::paintEvent(QPaintEvent *event)
 {
-	Q_UNUSED(event);
+	// 更新された領域(event->region())だけを描く。枠と背景は、露出した領域が
+	// 画像の外側にかかるとき(リサイズやレイアウト変更)にだけ描き直す。
+	const QRegion exposed = event->region();
 	QPainter painter(this);
 	QRect r;
+	bool probe_hit = false;
 	if (m->rdp_instance) {
-		std::lock_guard lock(m->mutex);
-		if (!m->painting_image.isNull()) {
+		DamageRegion damage;
+		qint64 damage_time;
+		{
+			std::lock_guard lock(m->mutex);
+			damage = m->scaled_damage;
+			damage_time = m->scaled_damage_time;
+			m->scaled_damage.clear();
+			m->scaled_damage_time = 0;
+		}
+		// 計測中の入力より後のEndPaintで、ポインタの近くが変化したか
+		if (m->probe_time != 0 && damage_time > m->probe_time) {
+			for (QRect const &d : damage) {
+				if (m->probe_rect.isEmpty() || d.intersects(m->probe_rect)) {
+					probe_hit = true;
+					break;
+				}
+			}
+		}
+		// frontはGUIスレッドだけが触れるバッファなので、ロックもコピーも不要
+		m->ring.acquire();
+		QImage const &image = m->ring.frontImage();
+		if (!image.isNull()) {
+			const int scale = m->scale;
 			int x = -m->offset_x;
 			int y = -m->offset_y;
-			int w = m->painting_image.width() * m->scale;
-			int h = m->painting_image.height() * m->scale;
+			int w = image.width() * scale;
+			int h = image.height() * scale;
 			r = {x, y, w, h};
-			painter.drawImage(r, m->painting_image, m->painting_image.rect());
+			if (scale > 1) {
+				// 拡大はQPainterの汎用の変換に任せず、変化した矩形だけを
+				// 拡大済みの画面へ反映しておき、描画は等倍で転送する
+				if (m->scaled_image.size() != image.size() * scale || m->scaled_image.format() != image.format()) {
+					m->scaled_image = QImage(image.size() * scale, image.format());
+					damage.clear();
+					damage.add(image.rect());
+				}
+				for (QRect const &d : damage) {
+					ImageScaler::scale(&m->scaled_image, image, d, scale);
+				}
+				for (QRect const &t : exposed & r) {
+					painter.drawImage(t.topLeft(), m->scaled_image, t.translated(-x, -y));
+				}
+			} else {
+				for (QRect const &t : exposed & r) {
+					painter.drawImage(t.topLeft(), image, t.translated(-x, -y));
+				}
+			}
 		}
 	}
-	{
+	if (!r.contains(exposed.boundingRect())) {
 		painter.save();
 		int x = r.x();
 		int y = r.y();
 		int w = r.width();
 		int h = r.height();
-		QPainterPath path;
-		QPainterPath imgrect;
-		path.addRect(rect());
-		imgrect.addRect(x, y, w, h);
-		path = path.subtracted(imgrect);
-		painter.setClipPath(path);
+		painter.setClipRegion(exposed.subtracted(r));
 		painter.fillRect(rect(), QColor(192, 192, 192));
 		painter.fillRect(x - 1, y - 1, w + 2, 1, Qt::black);
 		painter.fillRect(x - 1, y - 1, 1, h + 2, Qt::black);
@@ -243,12 +659,42 @@ void MyView::paintEvent(QPaintEvent *event)
 		painter.fillRect(x + w + 1, y, 1, h + 2, QColor(255, 255, 255));
 		painter.restore();
 	}
-	if (1) {
-		painter.setPen(Qt::black);
-		painter.setFont(QFont("Arial", 10));
-		painter.drawText(10, 20, QString("FPS: %1").arg(m->fps));
+	if (m->dimmed) {
+		painter.fillRect(r, QColor(0, 0, 0, 128));
+	}
+	if (m->overlay_visible && exposed.intersects(overlayRect())) {
+		drawOverlay(&painter);
 	}
+	painter.end();
 	m->frame_count++;
+
+	if (m->probe_time != 0) {
+		const qint64 now = FrameStats::now();
+		if (probe_hit) {
+			recordInputLatency(now - m->probe_time);
+			m->probe_time = 0;
+		} else if (now - m->probe_time > INPUT_PROBE_TIMEOUT_NS) {
+			m->probe_time = 0; // 応答がなかった
+		}
+	}
+
+	// 画面の内容を描いたときだけ、そのフレームの時刻を記録する
+	Private::FrameTimes times;
+	if (exposed.intersects(r)) {
+		std::lock_guard lock(m->mutex);
+		std::swap(times, m->presenting_times);
+	}
+	if (times.end_paint != 0) {
+		// 描画したフレームの時刻を記録する。バッキングストアのフラッシュはこのpaintEventを
+		// 呼び出したイベントの処理の最後に行われるので、その次にキューされた処理で完了時刻とする。
+		const qint64 painted = FrameStats::now();
+		m->frame_stats.record(FrameStats::Paint, painted - times.composed);
+		QMetaObject::invokeMethod(this, [this, times, painted]() {
+			const qint64 flushed = FrameStats::now();
+			m->frame_stats.record(FrameStats::Flush, flushed - painted);
+			m->frame_stats.record(FrameStats::Total, flushed - times.end_paint);
+		}, Qt::QueuedConnection);
+	}
 }
 
 void MyView::mousePressEvent(QMouseEvent *event)
@@ -259,7 +705,10 @@ void MyView::mousePressEvent(QMouseEvent *event)
 		if (button != 0) {
 			flags |= button;
 			QPoint pos = mapToRdp(event);
-			freerdp_input_send_mouse_event(m->rdp_instance->context->input, flags, pos.x(), pos.y());
+			m->last_pointer_pos = pos;
+			startInputProbe();
+			flushMouseMove();
+			pushMouseEvent(flags, pos);
 		}
 	}
 	setFocus();
@@ -271,7 +720,8 @@ void MyView::mouseReleaseEvent(QMouseEvent *event)
 		UINT16 button = qtToRdpMouseButton(event->button());
 		if (button != 0) {
 			QPoint pos = mapToRdp(event);
-			freerdp_input_send_mouse_event(m->rdp_instance->context->input, button, pos.x(), pos.y());
+			flushMouseMove();
+			pushMouseEvent(button, pos);
 		}
 	}
 }
@@ -279,8 +729,31 @@ void MyView::mouseReleaseEvent(QMouseEvent *event)
 void MyView::mouseMoveEvent(QMouseEvent *event)
 {
 	if (m->rdp_instance && m->rdp_instance->context) {
-		QPoint pos = mapToRdp(event);
-		freerdp_input_send_mouse_event(m->rdp_instance->context->input, PTR_FLAGS_MOVE, pos.x(), pos.y());
+		if (m->move_pending) {
+			m->moves_coalesced++; // 送る前の位置は最新の位置で置き換える
+		}
+		m->move_pos = mapToRdp(event);
+		m->last_pointer_pos = m->move_pos;
+		m->move_pending = true;
+		const qint64 elapsed = m->last_move_sent.isValid() ? m->last_move_sent.elapsed() : MOUSE_MOVE_INTERVAL_MS;
+		if (elapsed >= MOUSE_MOVE_INTERVAL_MS) {
+			flushMouseMove();
+		} else if (!m->move_timer.isActive()) {
+			m->move_timer.start(int(MOUSE_MOVE_INTERVAL_MS - elapsed));
+		}
+	}
+}
+
+// 溜まっているマウス移動があれば送る
+void MyView::flushMouseMove()
+{
+	m->move_timer.stop();
+	if (!m->move_pending) return;
+	m->move_pending = false;
+	if (m->rdp_instance && m->rdp_instance->context) {
+		pushMouseEvent(PTR_FLAGS_MOVE, m->move_pos);
+		m->last_move_sent.start();
+		m->moves_sent++;
 	}
 }
 
@@ -301,54 +774,78 @@ void MyView::wheelEvent(QWheelEvent *event)
 	if (m->rdp_instance && m->rdp_instance->context) {
 		auto delta = event->angleDelta();
 		QPoint pos = mapToRdp(event);
+		flushMouseMove();
 		if (delta.y() != 0) {
 			// 垂直スクロール（一般的なマウスホイール）
 			UINT16 flags = PTR_FLAGS_WHEEL | encodeWheelRotation(delta.y());
 			// qDebug() << Q_FUNC_INFO << flags;
-			freerdp_input_send_mouse_event(m->rdp_instance->context->input, flags, pos.x(), pos.y());
+			pushMouseEvent(flags, pos);
 		} else if (delta.x() != 0) {
 			// 水平スクロール（ホイールチルト）
 			UINT16 flags = PTR_FLAGS_HWHEEL | encodeWheelRotation(delta.x());
-			freerdp_input_send_mouse_event(m->rdp_instance->context->input, flags, pos.x(), pos.y());
+			pushMouseEvent(flags, pos);
 		}
 	}
 }
 
-bool MyView::sendRdpKeyboardEvent(Key const &k)
+// 入力をキューへ積んでRDPスレッドを起こす
+bool MyView::pushInput(InputEvent const &e)
 {
-	if (m->rdp_instance && m->rdp_instance->context && m->rdp_instance->context->input) {
-		// qDebug() << k.vk << k.pressed;
-		auto code = GetVirtualScanCodeFromVirtualKeyCode(k.vk, WINPR_KBD_TYPE_IBM_ENHANCED);
-		freerdp_input_send_keyboard_event_ex(m->rdp_instance->context->input, k.pressed, k.autorepeat, code);
-		return true;
+	if (!m->rdp_instance) return false;
+	if (!m->input_queue.push(e)) {
+		qWarning() << "input queue is full";
+		return false;
 	}
-	return false;
+	emit inputAvailable();
+	return true;
 }
 
-bool MyView::sendKeyChunk()
+void MyView::pushMouseEvent(UINT16 flags, QPoint const &pos)
 {
-	bool ret = false;
-	std::vector<Key> keys;
-	if (!m->key_event_queue.empty()) {
-		keys = std::move(m->key_event_queue.front());
-		m->key_event_queue.pop_front();
-	}
-	for (const auto &key : keys) {
-		if (key.vk != VK_NONE) {
-			ret = sendRdpKeyboardEvent(key);
-		}
-	}
-	return ret;
+	InputEvent e;
+	e.type = InputEvent::Mouse;
+	e.flags = flags;
+	e.x = UINT16(std::clamp(pos.x(), 0, 0xffff));
+	e.y = UINT16(std::clamp(pos.y(), 0, 0xffff));
+	pushInput(e);
 }
 
+// 区切りを挟まずにキーを送る
+bool MyView::sendRdpKeyboardEvent(Key const &k)
+{
+	flushMouseMove();
+	InputEvent e;
+	e.type = InputEvent::Key;
+	e.vk = k.vk;
+	e.pressed = k.pressed;
+	e.autorepeat = k.autorepeat;
+	return pushInput(e);
+}
+
+// RDPスレッドから呼ばれる: 溜まっている入力を送る。戻り値はInputQueue::drainと同じ。
+int MyView::drainInput(rdpInput *input)
+{
+	return m->input_queue.drain(input);
+}
+
+// RDPスレッドで実行する: 溜まっている入力を送らずに捨てる
+void MyView::discardInput()
+{
+	m->input_queue.clear();
+}
+
+// 以降のキーは、前の区切りから少なくともInputQueue::CHUNK_INTERVAL_MS空けて送る
 void MyView::addKeyChunk()
 {
-	m->key_event_queue.push_back({});
+	InputEvent e;
+	e.type = InputEvent::Chunk;
+	pushInput(e);
 }
 
 void MyView::addKey(DWORD vk, bool press)
 {
-	m->key_event_queue.back().emplace_back(vk, press, false);
+	if (vk == VK_NONE) return;
+	sendRdpKeyboardEvent({vk, press, false});
 }
 
 void MyView::sendKeyboardModifiers(Qt::KeyboardModifiers mod)
@@ -390,10 +887,12 @@ bool MyView::onKeyEvent(QKeyEvent *event)
 {
 	bool pressed = event->type() == QEvent::KeyPress;
 	auto vk = GetVirtualKeyCodeFromKeycode(event->nativeScanCode(), WINPR_KEYCODE_TYPE_XKB);
-	// return sendRdpKeyboardEvent({vk, pressed, event->isAutoRepeat()});
+	if (vk == VK_NONE) return false;
+	if (pressed && !event->isAutoRepeat() && m->rdp_instance) {
+		startInputProbe();
+	}
 	addKeyChunk();
-	addKey(vk, pressed);
-	return sendKeyChunk();
+	return sendRdpKeyboardEvent({vk, pressed, event->isAutoRepeat()});
 }
 
 UINT16 MyView::qtToRdpMouseButton(Qt::MouseButton button)
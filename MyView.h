@@ -3,12 +3,17 @@
 
 #include <QKeyEvent>
 #include <QMouseEvent>
+#include <QStringList>
 #include <QWidget>
 #include <freerdp/freerdp.h>
 #include <freerdp/input.h>
 #include <type_traits>
+#include <vector>
 
 class CommandForm;
+class QPainter;
+class DamageRegion;
+struct InputEvent;
 
 class MyView : public QWidget {
 	Q_OBJECT
@@ -33,6 +38,11 @@ private:
 	void startThread();
 	void stopThread();
 	void notifyAll();
+	qint64 presentIntervalNsecs() const;
+	void schedulePresent();
+	void publishFrame(const QImage &screen, const DamageRegion &damage, qint64 end_paint_time);
+	bool pushInput(const InputEvent &e);
+	void pushMouseEvent(UINT16 flags, const QPoint &pos);
 protected:
 	void paintEvent(QPaintEvent *event) override;
 	void mousePressEvent(QMouseEvent *event) override;
@@ -44,16 +54,34 @@ public:
 	explicit MyView(QWidget *parent = nullptr);
 	~MyView();
 	void setImage(const QImage &image, const QRect &rect);
+	void setDamage(const QImage &screen, const std::vector<QRect> &rects, qint64 end_paint_time);
 	void setRdpInstance(freerdp *instance);
 
 	int scale() const;
 	void setScale(int scale);
+	void setMaxFps(int fps);
 
 	void layoutView(bool update_view);
 	
 	void showCommandForm(bool show);
 	bool isCommandFormVisible() const;
 
+	bool isStatisticsOverlayVisible() const;
+	void setStatisticsOverlayVisible(bool visible);
+	QString saveFrameStatistics(const QString &dir) const;
+	void recordReconnect(qint64 nsecs);
+	void setSessionStatistics(const QStringList &lines);
+	void setDimmed(bool dimmed);
+	void setInputLatencyProbeRadius(int radius);
+
+	void addRemoteCursor(quint64 id, const QImage &image, const QPoint &hotspot);
+	void removeRemoteCursor(quint64 id);
+	void setRemoteCursor(quint64 id);
+	void setRemoteCursorHidden();
+	void setRemoteCursorDefault();
+	void moveRemoteCursor(const QPoint &pos);
+	QString saveInputLatency(const QString &dir);
+
 	bool onKeyEvent(QKeyEvent *event);
 	bool sendRdpKeyboardEvent(const Key &k);
 	void sendKeyboardModifiers(Qt::KeyboardModifiers mod);
@@ -61,7 +89,15 @@ public:
 	void addKeyChunk();
 	void addKey(DWORD vk, bool press);
 	void addNativeKey(quint32 native, bool pressed);
+	int drainInput(rdpInput *input);
+	void discardInput();
 private:
+	QRect overlayRect() const;
+	QFont overlayFont() const;
+	void updateOverlayText();
+	void drawOverlay(QPainter *painter);
+	void startInputProbe();
+	void recordInputLatency(qint64 nsecs);
 	QPoint mapToRdp(const QPoint &pos) const;
 	template <typename T> QPoint mapToRdp(T const *e) const
 	{
@@ -72,11 +108,14 @@ private:
 		}
 	}
 private slots:
-	void kickUpdate();
-public slots:
-	bool sendKeyChunk();
+	void kickUpdate(const QRegion &region);
+	void present();
+	void flushMouseMove();
 signals:
-	void ready();
+	void ready(const QRegion &region);
+	void presented();
+	void inputAvailable();
+	void inputLatencyChanged(qint64 p50_usecs, qint64 p95_usecs);
 };
 
 #endif // MYVIEW_H
@@ -0,0 +1,69 @@
+#include "NetworkProfile.h"
+#include <QObject>
+
+namespace {
+
+// これより速ければLAN。帯域が未計測のときはRTTだけで決める。
+constexpr quint32 LAN_MAX_RTT_MS = 10;
+constexpr quint32 LAN_MIN_BANDWIDTH_KBPS = 100 * 1000;
+// これより遅ければ低速回線
+constexpr quint32 SLOW_MIN_RTT_MS = 150;
+constexpr quint32 SLOW_MAX_BANDWIDTH_KBPS = 5 * 1000;
+
+} // namespace
+
+NetworkProfile NetworkProfiles::select(NetworkMeasurement const &measurement)
+{
+	if (!measurement.isValid()) return NetworkProfile::Lan;
+	const quint32 rtt = measurement.average_rtt_ms;
+	const quint32 bandwidth = measurement.bandwidth_kbps;
+	if (rtt >= SLOW_MIN_RTT_MS || (bandwidth != 0 && bandwidth < SLOW_MAX_BANDWIDTH_KBPS)) return NetworkProfile::Slow;
+	if (rtt <= LAN_MAX_RTT_MS && (bandwidth == 0 || bandwidth >= LAN_MIN_BANDWIDTH_KBPS)) return NetworkProfile::Lan;
+	return NetworkProfile::Wan;
+}
+
+QString NetworkProfiles::name(NetworkProfile profile)
+{
+	switch (profile) {
+	case NetworkProfile::Lan: return QObject::tr("LAN (AVC444)");
+	case NetworkProfile::Wan: return QObject::tr("WAN (AVC420/progressive)");
+	case NetworkProfile::Slow: return QObject::tr("Slow link (AVC420/progressive, compressed)");
+	}
+	return {};
+}
+
+void NetworkProfiles::applyCodec(rdpSettings *settings, NetworkProfile profile, bool gfx)
+{
+	const bool lan = profile == NetworkProfile::Lan;
+
+	// AVC444はクロマを落とさない代わりに、AVC420のほぼ倍のビットレートを使う。
+	// AVC444を切ると、サーバーはAVC420か、RemoteFXのプログレッシブ(粗い画像から順に詳細を送る)を選ぶ。
+	freerdp_settings_set_bool(settings, FreeRDP_SupportGraphicsPipeline, gfx);
+	freerdp_settings_set_bool(settings, FreeRDP_GfxH264, true);
+	freerdp_settings_set_bool(settings, FreeRDP_GfxAVC444, lan);
+	freerdp_settings_set_bool(settings, FreeRDP_GfxAVC444v2, lan);
+	freerdp_settings_set_bool(settings, FreeRDP_GfxProgressive, !lan);
+	freerdp_settings_set_bool(settings, FreeRDP_GfxProgressiveV2, !lan);
+	freerdp_settings_set_bool(settings, FreeRDP_RemoteFxCodec, false);
+	freerdp_settings_set_uint32(settings, FreeRDP_ColorDepth, 32);
+}
+
+void NetworkProfiles::applyCompression(rdpSettings *settings, NetworkMeasurement const &measurement)
+{
+	// バルク圧縮はCPUを使うので、計測でLANと分かったときだけ切る。低速回線では最も縮むXCRUSH(RDP6.1)まで許す。
+	// 圧縮はセッションの間ずっと変えられないので、初めての接続(未計測)で切ると遅い回線でも圧縮なしになる。
+	const NetworkProfile profile = measurement.isValid() ? select(measurement) : NetworkProfile::Wan;
+	switch (profile) {
+	case NetworkProfile::Lan:
+		freerdp_settings_set_bool(settings, FreeRDP_CompressionEnabled, false);
+		break;
+	case NetworkProfile::Wan:
+		freerdp_settings_set_bool(settings, FreeRDP_CompressionEnabled, true);
+		freerdp_settings_set_uint32(settings, FreeRDP_CompressionLevel, PACKET_COMPR_TYPE_64K);
+		break;
+	case NetworkProfile::Slow:
+		freerdp_settings_set_bool(settings, FreeRDP_CompressionEnabled, true);
+		freerdp_settings_set_uint32(settings, FreeRDP_CompressionLevel, PACKET_COMPR_TYPE_RDP61);
+		break;
+	}
+}
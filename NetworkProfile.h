@@ -0,0 +1,40 @@
+#ifndef NETWORKPROFILE_H
+#define NETWORKPROFILE_H
+
+#include <QString>
+#include <freerdp/settings.h>
+
+// サーバーのネットワーク自動検出(Network Characteristics Result)で通知された回線の状態
+struct NetworkMeasurement {
+	quint32 base_rtt_ms = 0;	// 最小のRTT
+	quint32 average_rtt_ms = 0; // 平均のRTT
+	quint32 bandwidth_kbps = 0; // 帯域(0: 未計測)
+	int samples = 0;			// 受け取った回数
+
+	bool isValid() const { return samples > 0; }
+};
+
+// 回線に合わせて選ぶコーデックと圧縮の組み合わせ。
+// 設定は接続(と再接続)のときにしか交渉されないので、接続中に計測が変わっても次の再接続まで使われない。
+enum class NetworkProfile {
+	Lan,  // AVC444(クロマを落とさない)、バルク圧縮なし
+	Wan,  // AVC420とプログレッシブ、バルク圧縮は軽いもの
+	Slow, // AVC420とプログレッシブ、最も縮むバルク圧縮
+};
+
+namespace NetworkProfiles {
+
+// 計測から選ぶ。計測がなければLan(自動検出のない従来の設定)を返す。
+NetworkProfile select(NetworkMeasurement const &measurement);
+// 状態バーに出す名前("LAN (AVC444)"など)
+QString name(NetworkProfile profile);
+// Graphics Pipelineで使うコーデックを設定する。gfxはGraphics Pipelineを使うセッションか。
+// コーデックはアクティブになった後に交渉されるので、接続時の自動検出の結果で選び直せる。
+void applyCodec(rdpSettings *settings, NetworkProfile profile, bool gfx);
+// 計測に合わせてバルク圧縮を設定する。Client Infoで伝えた後は変えてはいけないので、接続と再接続の前だけに呼ぶ。
+// 計測がなければ、遅い回線かもしれないのでWANと同じく圧縮する。
+void applyCompression(rdpSettings *settings, NetworkMeasurement const &measurement);
+
+} // namespace NetworkProfiles
+
+#endif // NETWORKPROFILE_H
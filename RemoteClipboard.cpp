@@ -0,0 +1,169 @@
+#include "RemoteClipboard.h"
+#include "ClipboardCodec.h"
+#include <QtEndian>
+#include <chrono>
+
+static constexpr char IMAGE_MIME[] = "application/x-qt-image";
+static constexpr char PNG_MIME[] = "image/png";
+static constexpr char TEXT_MIME[] = "text/plain";
+
+void RemoteClipboard::setChannel(CliprdrClientContext *cliprdr)
+{
+	std::lock_guard lock(mutex);
+	this->cliprdr = cliprdr;
+	channel_serial++;
+	generation++;
+	requested_format = 0;
+	cv.notify_all(); // 待っている要求をあきらめさせる
+}
+
+quint64 RemoteClipboard::announce()
+{
+	std::lock_guard lock(mutex);
+	generation++;
+	cv.notify_all();
+	return generation;
+}
+
+QByteArray RemoteClipboard::fetch(quint64 generation, UINT32 format, int timeout_ms)
+{
+	using clock = std::chrono::steady_clock;
+	const auto deadline = clock::now() + std::chrono::milliseconds(timeout_ms);
+	std::unique_lock fetch_lock(fetch_mutex, std::defer_lock);
+	if (!fetch_lock.try_lock_until(deadline)) return {};
+	std::unique_lock lock(mutex);
+	for (int attempt = 1; attempt <= FETCH_ATTEMPTS; attempt++) {
+		if (!cliprdr || !cliprdr->ClientFormatDataRequest || this->generation != generation) break;
+		CliprdrClientContext *channel = cliprdr;
+		requested_format = format;
+		responded = false;
+		response_data.clear();
+		lock.unlock();
+
+		CLIPRDR_FORMAT_DATA_REQUEST request = {};
+		request.requestedFormatId = format;
+		const UINT status = channel->ClientFormatDataRequest(channel, &request);
+
+		lock.lock();
+		if (status != CHANNEL_RC_OK) break;
+		auto stale = [&]() { return this->generation != generation; };
+		if (!cv.wait_until(lock, deadline, [&]() { return responded || stale(); })) break; // 時間切れ
+		if (stale()) break;
+		if (response_ok) {
+			requested_format = 0;
+			return std::move(response_data);
+		}
+		// サーバーは通知の直後の要求に失敗を返すことがあるので、少し待ってから要求し直す
+		cv.wait_until(lock, std::min(deadline, clock::now() + std::chrono::milliseconds(50 * attempt)), stale);
+	}
+	requested_format = 0;
+	return {};
+}
+
+bool RemoteClipboard::deliver(bool ok, const BYTE *data, UINT32 length)
+{
+	std::lock_guard lock(mutex);
+	if (requested_format == 0) return false;
+	requested_format = 0;
+	responded = true;
+	response_ok = ok;
+	response_data = ok ? QByteArray(reinterpret_cast<const char *>(data), length) : QByteArray();
+	cv.notify_all();
+	return true;
+}
+
+quint64 RemoteClipboard::channel()
+{
+	std::lock_guard lock(mutex);
+	return channel_serial;
+}
+
+bool RemoteClipboard::respond(quint64 channel, QByteArray const &data)
+{
+	// 送っている間にチャネルが閉じられないよう、ロックしたまま送る
+	std::lock_guard lock(mutex);
+	if (!cliprdr || channel_serial != channel) return false;
+	return sendResponse(cliprdr, data) == CHANNEL_RC_OK;
+}
+
+UINT RemoteClipboard::sendResponse(CliprdrClientContext *cliprdr, QByteArray const &data)
+{
+	if (!cliprdr->ClientFormatDataResponse) return CHANNEL_RC_OK;
+	CLIPRDR_FORMAT_DATA_RESPONSE response = {};
+	if (!data.isEmpty()) {
+		response.common.msgFlags = CB_RESPONSE_OK;
+		response.common.dataLen = data.size();
+		response.requestedFormatData = reinterpret_cast<const BYTE *>(data.constData());
+	} else {
+		response.common.msgFlags = CB_RESPONSE_FAIL;
+	}
+	return cliprdr->ClientFormatDataResponse(cliprdr, &response);
+}
+
+RemoteMimeData::RemoteMimeData(RemoteClipboardOffer offer)
+	: offer(std::move(offer))
+{
+}
+
+QByteArray RemoteMimeData::fetchPng() const
+{
+	if (!png_fetched) {
+		png_cache = offer.clipboard->fetch(offer.generation, offer.png_format);
+		png_fetched = !png_cache.isEmpty();
+	}
+	return png_cache;
+}
+
+QStringList RemoteMimeData::formats() const
+{
+	QStringList list;
+	if (offer.has_dib || offer.png_format) list.append(IMAGE_MIME);
+	if (offer.png_format) list.append(PNG_MIME);
+	if (offer.has_text) list.append(TEXT_MIME);
+	list.append(REMOTE_CLIPBOARD_MIME);
+	return list;
+}
+
+bool RemoteMimeData::hasFormat(QString const &mimetype) const
+{
+	return formats().contains(mimetype);
+}
+
+QVariant RemoteMimeData::retrieveData(QString const &mimetype, QMetaType preferredType) const
+{
+	Q_UNUSED(preferredType);
+	if (mimetype == REMOTE_CLIPBOARD_MIME) {
+		return QByteArrayLiteral("1");
+	}
+	if (mimetype == PNG_MIME && offer.png_format) {
+		// 展開せずにそのまま渡す
+		QByteArray png = fetchPng();
+		return png.isEmpty() ? QVariant() : QVariant(png);
+	}
+	if (mimetype == IMAGE_MIME && (offer.has_dib || offer.png_format)) {
+		if (!image_fetched) {
+			// 取れなかったときは、次に貼り付けられたときにもう一度取りに行く
+			if (offer.png_format) image_cache = ClipboardCodec::pngToImage(fetchPng());
+			if (image_cache.isNull() && offer.has_dib) image_cache = ClipboardCodec::dibToImage(offer.clipboard->fetch(offer.generation, CF_DIB));
+			image_fetched = !image_cache.isNull();
+		}
+		return image_cache.isNull() ? QVariant() : QVariant(image_cache);
+	}
+	if (mimetype.startsWith(TEXT_MIME) && offer.has_text) {
+		if (!text_fetched) {
+			QByteArray data = offer.clipboard->fetch(offer.generation, CF_UNICODETEXT);
+			if (data.isEmpty()) return {};
+			text_fetched = true;
+			const qsizetype units = data.size() / 2;
+			text_cache.reserve(units);
+			const auto *src = reinterpret_cast<const uchar *>(data.constData());
+			for (qsizetype i = 0; i < units; ++i) {
+				const quint16 ch = qFromLittleEndian<quint16>(src + i * 2);
+				if (ch == 0) break;
+				text_cache.append(QChar(ch));
+			}
+		}
+		return text_cache;
+	}
+	return {};
+}
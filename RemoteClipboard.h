@@ -0,0 +1,87 @@
+#ifndef REMOTECLIPBOARD_H
+#define REMOTECLIPBOARD_H
+
+#include <QByteArray>
+#include <QImage>
+#include <QMimeData>
+#include <QVariant>
+#include <condition_variable>
+#include <freerdp/client/cliprdr.h>
+#include <memory>
+#include <mutex>
+
+// リモートから来たクリップボードの内容であることを示す形式(ローカルの変更として扱わず、
+// 同じプロセスのRemoteMimeDataでなければどのサーバーへも送らない)
+static constexpr char REMOTE_CLIPBOARD_MIME[] = "application/x-radic-remote-clipboard";
+
+// サーバーのクリップボードの中身を要求して応答を待つための受け渡し口。
+// 要求はGUIスレッド、応答はcliprdrチャネルのスレッドから届く。
+// サーバーからの要求に、チャネルのスレッドの外から後で答えるときもここを通す。
+class RemoteClipboard {
+private:
+	std::timed_mutex fetch_mutex; // 要求と応答の組は一度に1つなので、fetchを順番に通す
+	std::mutex mutex;
+	std::condition_variable cv;
+	CliprdrClientContext *cliprdr = nullptr;
+	quint64 channel_serial = 0; // setChannelのたびに進む
+	quint64 generation = 0; // サーバーが形式を通知するたび(と接続が変わるたび)に進む
+	UINT32 requested_format = 0; // 応答を待っている形式(0: 待っていない)
+	bool responded = false;
+	bool response_ok = false;
+	QByteArray response_data;
+public:
+	static constexpr int FETCH_TIMEOUT_MS = 2000;
+	static constexpr int FETCH_ATTEMPTS = 5;
+
+	void setChannel(CliprdrClientContext *cliprdr);
+	// サーバーが新しい形式の一覧を通知した。新しい世代を返す。
+	quint64 announce();
+	// generationの世代のformatをサーバーへ要求し、最大でtimeout_msまで応答を待つ。
+	// サーバーが失敗を返したときは間隔を空けて何度か要求し直す。取れなければ空を返す。
+	// GUIスレッドのほか、別のセッションへ中継するときはそのチャネルのスレッドからも呼ばれる。
+	QByteArray fetch(quint64 generation, UINT32 format, int timeout_ms = FETCH_TIMEOUT_MS);
+	// チャネルのスレッドから応答を渡す。待っている要求がなければfalseを返す。
+	bool deliver(bool ok, const BYTE *data, UINT32 length);
+	// 今のチャネルの番号。要求を受けたときに控えておき、後で答えるときにrespondへ渡す。
+	quint64 channel();
+	// サーバーの要求にどのスレッドからでも答える(dataが空なら失敗を返す)。
+	// channelの後にチャネルが閉じられたりつなぎ直されたりしていれば送らない。
+	bool respond(quint64 channel, QByteArray const &data);
+	// サーバーの要求へのFormat Data Responseを送る
+	static UINT sendResponse(CliprdrClientContext *cliprdr, QByteArray const &data);
+};
+
+// サーバーが提示したクリップボードの形式と、中身を取りに行く先
+struct RemoteClipboardOffer {
+	std::shared_ptr<RemoteClipboard> clipboard;
+	quint64 generation = 0;
+	bool has_text = false;
+	bool has_dib = false;
+	UINT32 png_format = 0; // サーバーがPNGを提示していればその登録形式のID(0: なし)
+};
+
+// サーバーのクリップボードを、ローカルで貼り付けられたときに初めて取りに行くQMimeData。
+// 一度取り出した中身は保持しておき、同じ貼り付けで何度も要求しない。
+// 画像はPNGがあればそれを取り寄せ(image/pngとしてはそのまま渡す)、なければCF_DIBを使う。
+class RemoteMimeData : public QMimeData {
+	Q_OBJECT
+private:
+	RemoteClipboardOffer offer;
+	mutable bool text_fetched = false;
+	mutable bool image_fetched = false;
+	mutable bool png_fetched = false;
+	mutable QString text_cache;
+	mutable QImage image_cache;
+	mutable QByteArray png_cache;
+	QByteArray fetchPng() const;
+public:
+	explicit RemoteMimeData(RemoteClipboardOffer offer);
+	// 同じプロセスの別のセッションは、ここから直接サーバーのクリップボードを取りに行く
+	const RemoteClipboardOffer &source() const { return offer; }
+	QStringList formats() const override;
+	bool hasFormat(const QString &mimetype) const override;
+protected:
+	QVariant retrieveData(const QString &mimetype, QMetaType preferredType) const override;
+};
+
+#endif // REMOTECLIPBOARD_H
@@ -0,0 +1,246 @@
+#include "SessionStats.h"
+#include "FrameStats.h"
+#include <QJsonArray>
+#include <QObject>
+#include <algorithm>
+#include <cstring>
+#include <freerdp/channels/rdpgfx.h>
+
+namespace {
+
+QString bytesPerSecond(quint64 bytes)
+{
+	if (bytes >= 1024 * 1024) return QString("%1 MB/s").arg(bytes / (1024.0 * 1024.0), 0, 'f', 1);
+	return QString("%1 KB/s").arg(bytes / 1024.0, 0, 'f', 1);
+}
+
+} // namespace
+
+quint64 SessionStatsSample::bytesIn() const
+{
+	quint64 n = 0;
+	for (Channel const &c : channels) {
+		n += c.bytes_in;
+	}
+	return n;
+}
+
+QString SessionStatsSample::summary() const
+{
+	QString text = QObject::tr("In %1  Out %2  %3 fps").arg(bytesPerSecond(bytesIn())).arg(bytesPerSecond(bytes_out)).arg(frames, 0, 'f', 0);
+	if (!codec.isEmpty()) {
+		text += QObject::tr("  %1 %2 ms").arg(codec).arg(decode_ms, 0, 'f', 1);
+	}
+	return text;
+}
+
+QStringList SessionStatsSample::overlayLines() const
+{
+	QStringList lines;
+	lines.append(QString("Decoded: %1/s  coalesced: %2/s").arg(frames, 0, 'f', 0).arg(coalesced, 0, 'f', 0));
+	if (!codec.isEmpty()) {
+		lines.append(QString("Codec: %1  decode avg %2 ms").arg(codec).arg(decode_ms, 0, 'f', 2));
+	}
+	if (rtt_ms != 0) {
+		lines.append(QString("RTT: %1 ms  bandwidth: %2 Mbps").arg(rtt_ms).arg(bandwidth_kbps / 1000.0, 0, 'f', 1));
+	}
+	lines.append(QString("Out: %1 total").arg(bytesPerSecond(bytes_out)));
+	lines.append(QString("%1 %2 %3 %4 %5").arg("channel", -8).arg("in KB/s", 9).arg("PDU/s", 6).arg("out KB/s", 9).arg("PDU/s", 6));
+	for (Channel const &c : channels) {
+		lines.append(QString("%1 %2 %3 %4 %5")
+						 .arg(c.name, -8)
+						 .arg(c.bytes_in / 1024.0, 9, 'f', 1)
+						 .arg(c.pdus_in, 6)
+						 .arg(c.bytes_out / 1024.0, 9, 'f', 1)
+						 .arg(c.pdus_out, 6));
+	}
+	return lines;
+}
+
+QJsonObject SessionStatsSample::toJson() const
+{
+	QJsonArray channel_array;
+	for (Channel const &c : channels) {
+		QJsonObject obj;
+		obj["name"] = c.name;
+		obj["bytes_in_per_s"] = qint64(c.bytes_in);
+		obj["bytes_out_per_s"] = qint64(c.bytes_out);
+		obj["pdus_in_per_s"] = qint64(c.pdus_in);
+		obj["pdus_out_per_s"] = qint64(c.pdus_out);
+		channel_array.append(obj);
+	}
+	QJsonObject obj;
+	obj["seconds"] = seconds;
+	obj["bytes_in_per_s"] = qint64(bytesIn());
+	obj["bytes_out_per_s"] = qint64(bytes_out);
+	obj["channels"] = channel_array;
+	obj["rtt_ms"] = qint64(rtt_ms);
+	obj["bandwidth_kbps"] = qint64(bandwidth_kbps);
+	obj["codec"] = codec;
+	obj["codecs"] = codecs;
+	obj["frames_per_s"] = frames;
+	obj["coalesced_per_s"] = coalesced;
+	obj["decode_ms"] = decode_ms;
+	return obj;
+}
+
+SessionStats::Channel *SessionStats::channel(freerdp *instance, quint16 id)
+{
+	for (Channel &c : channels) {
+		quint32 current = c.id.load(std::memory_order_acquire);
+		if (current == 0) {
+			// 空いていれば取る。他のスレッドが先に取ったときはその値で比べ直す。
+			if (c.id.compare_exchange_strong(current, id, std::memory_order_acq_rel)) {
+				if (char const *name = freerdp_channels_get_name_by_id(instance, id)) {
+					strncpy(c.name, name, sizeof(c.name) - 1);
+				}
+				c.named.store(true, std::memory_order_release);
+				return &c;
+			}
+		}
+		if (current == id) return &c;
+	}
+	return nullptr; // 数え切れないチャネルは捨てる
+}
+
+void SessionStats::recordChannelIn(freerdp *instance, quint16 id, size_t bytes)
+{
+	if (Channel *c = channel(instance, id)) {
+		c->bytes_in.fetch_add(bytes, std::memory_order_relaxed);
+		c->pdus_in.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void SessionStats::recordChannelOut(freerdp *instance, quint16 id, size_t bytes)
+{
+	if (Channel *c = channel(instance, id)) {
+		c->bytes_out.fetch_add(bytes, std::memory_order_relaxed);
+		c->pdus_out.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void SessionStats::recordTransportSent(quint64 total_bytes)
+{
+	// 再接続でトランスポートが作り直されると、数え直しになって前回より小さくなる
+	const quint64 d = total_bytes >= transport_last ? total_bytes - transport_last : total_bytes;
+	transport_last = total_bytes;
+	transport_sent.fetch_add(d, std::memory_order_relaxed);
+}
+
+void SessionStats::recordSurfaceCommand(quint32 codec_id, qint64 nsecs)
+{
+	if (codec_id < MAX_CODECS) {
+		codec_commands[codec_id].fetch_add(1, std::memory_order_relaxed);
+	}
+	decode_nsecs.fetch_add(quint64(std::max<qint64>(nsecs, 0)), std::memory_order_relaxed);
+	decode_count.fetch_add(1, std::memory_order_relaxed);
+}
+
+void SessionStats::recordFrame(bool coalesced)
+{
+	frames.fetch_add(1, std::memory_order_relaxed);
+	if (coalesced) {
+		this->coalesced.fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+void SessionStats::recordNetwork(quint32 rtt_ms, quint32 bandwidth_kbps)
+{
+	this->rtt_ms.store(rtt_ms, std::memory_order_relaxed);
+	this->bandwidth_kbps.store(bandwidth_kbps, std::memory_order_relaxed);
+}
+
+SessionStats::Cursor SessionStats::reset()
+{
+	for (Channel &c : channels) {
+		c.id.store(0, std::memory_order_relaxed);
+		c.named.store(false, std::memory_order_relaxed);
+		memset(c.name, 0, sizeof(c.name));
+		c.bytes_in.store(0, std::memory_order_relaxed);
+		c.bytes_out.store(0, std::memory_order_relaxed);
+		c.pdus_in.store(0, std::memory_order_relaxed);
+		c.pdus_out.store(0, std::memory_order_relaxed);
+	}
+	for (auto &n : codec_commands) {
+		n.store(0, std::memory_order_relaxed);
+	}
+	transport_sent.store(0, std::memory_order_relaxed);
+	transport_last = 0;
+	decode_nsecs.store(0, std::memory_order_relaxed);
+	decode_count.store(0, std::memory_order_relaxed);
+	frames.store(0, std::memory_order_relaxed);
+	coalesced.store(0, std::memory_order_relaxed);
+	rtt_ms.store(0, std::memory_order_relaxed);
+	bandwidth_kbps.store(0, std::memory_order_relaxed);
+	Cursor cursor;
+	cursor.time = FrameStats::now();
+	return cursor;
+}
+
+SessionStatsSample SessionStats::sample(Cursor *cursor) const
+{
+	Cursor &last = *cursor;
+	const qint64 now = FrameStats::now();
+	SessionStatsSample s;
+	s.seconds = (now - last.time) / 1e9;
+	last.time = now;
+	if (s.seconds <= 0) return s;
+	auto delta = [](quint64 current, quint64 &previous) {
+		const quint64 d = current - previous;
+		previous = current;
+		return d;
+	};
+	auto rate = [&](quint64 d) { return quint64(d / s.seconds + 0.5); };
+
+	for (int i = 0; i < MAX_CHANNELS; i++) {
+		Channel const &c = channels[i];
+		const quint32 id = c.id.load(std::memory_order_acquire);
+		if (id == 0) continue;
+		SessionStatsSample::Channel sc;
+		sc.name = c.named.load(std::memory_order_acquire) ? QString::fromLatin1(c.name) : QString("#%1").arg(id);
+		sc.bytes_in = rate(delta(c.bytes_in.load(std::memory_order_relaxed), last.channel_bytes_in[i]));
+		sc.bytes_out = rate(delta(c.bytes_out.load(std::memory_order_relaxed), last.channel_bytes_out[i]));
+		sc.pdus_in = rate(delta(c.pdus_in.load(std::memory_order_relaxed), last.channel_pdus_in[i]));
+		sc.pdus_out = rate(delta(c.pdus_out.load(std::memory_order_relaxed), last.channel_pdus_out[i]));
+		if (sc.pdus_in == 0 && sc.pdus_out == 0 && sc.bytes_in == 0 && sc.bytes_out == 0) continue;
+		s.channels.push_back(sc);
+	}
+
+	quint64 top = 0;
+	for (int i = 0; i < MAX_CODECS; i++) {
+		const quint64 d = delta(codec_commands[i].load(std::memory_order_relaxed), last.codec_commands[i]);
+		if (d == 0) continue;
+		s.codecs[codecName(i)] = qint64(d);
+		if (d > top) {
+			top = d;
+			s.codec = codecName(i);
+		}
+	}
+
+	s.bytes_out = rate(delta(transport_sent.load(std::memory_order_relaxed), last.transport_sent));
+	const quint64 decode_n = delta(decode_nsecs.load(std::memory_order_relaxed), last.decode_nsecs);
+	const quint64 decode_c = delta(decode_count.load(std::memory_order_relaxed), last.decode_count);
+	s.decode_ms = decode_c ? decode_n / 1e6 / decode_c : 0;
+	s.frames = delta(frames.load(std::memory_order_relaxed), last.frames) / s.seconds;
+	s.coalesced = delta(coalesced.load(std::memory_order_relaxed), last.coalesced) / s.seconds;
+	s.rtt_ms = rtt_ms.load(std::memory_order_relaxed);
+	s.bandwidth_kbps = bandwidth_kbps.load(std::memory_order_relaxed);
+	return s;
+}
+
+char const *SessionStats::codecName(quint32 codec_id)
+{
+	switch (codec_id) {
+	case RDPGFX_CODECID_UNCOMPRESSED: return "uncompressed";
+	case RDPGFX_CODECID_CAVIDEO: return "RemoteFX";
+	case RDPGFX_CODECID_CLEARCODEC: return "ClearCodec";
+	case RDPGFX_CODECID_CAPROGRESSIVE: return "progressive";
+	case RDPGFX_CODECID_CAPROGRESSIVE_V2: return "progressive v2";
+	case RDPGFX_CODECID_PLANAR: return "planar";
+	case RDPGFX_CODECID_AVC420: return "AVC420";
+	case RDPGFX_CODECID_ALPHA: return "alpha";
+	case RDPGFX_CODECID_AVC444: return "AVC444";
+	case RDPGFX_CODECID_AVC444v2: return "AVC444v2";
+	default: return "other";
+	}
+}
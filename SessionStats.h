@@ -0,0 +1,100 @@
+#ifndef SESSIONSTATS_H
+#define SESSIONSTATS_H
+
+#include <QJsonObject>
+#include <QString>
+#include <QStringList>
+#include <atomic>
+#include <freerdp/freerdp.h>
+#include <vector>
+
+// 1秒あたりなどに直した、ある区間のセッションの統計
+struct SessionStatsSample {
+	struct Channel {
+		QString name;
+		quint64 bytes_in = 0; // 1秒あたり
+		quint64 bytes_out = 0;
+		quint64 pdus_in = 0;
+		quint64 pdus_out = 0;
+	};
+	double seconds = 0; // 区間の長さ
+	quint64 bytes_out = 0; // トランスポートが送ったバイト数(1秒あたり)
+	std::vector<Channel> channels; // 区間中に通信のあったチャネル
+	quint32 rtt_ms = 0; // 自動検出の平均RTT(0: 未計測)
+	quint32 bandwidth_kbps = 0;
+	QString codec; // 区間中に最も多く使われたGraphics Pipelineのコーデック(空: 使われていない)
+	QJsonObject codecs; // コーデックごとのサーフェスコマンドの数
+	double frames = 0; // デコードしたフレーム(EndPaint)の数(1秒あたり)
+	double coalesced = 0; // 表示待ちのために次のフレームへまとめた数(1秒あたり)
+	double decode_ms = 0; // サーフェスコマンド1つのデコードにかかった平均時間
+
+	quint64 bytesIn() const;
+	// 状態バーに出す1行
+	QString summary() const;
+	// 統計のオーバーレイに出す行
+	QStringList overlayLines() const;
+	QJsonObject toJson() const;
+};
+
+// 1つのセッションの通信と描画の統計。
+// RDPスレッドとチャネルのスレッドは緩いアトミックで数えるだけで、ロックを取らない。
+// GUIスレッドがsampleで定期的に読み出し、前回との差から区間の値を作る。
+class SessionStats {
+public:
+	static constexpr int MAX_CHANNELS = 16;
+	static constexpr int MAX_CODECS = 16;
+
+	// 前回読み出したときの値。読み出す間隔ごとに別々に持つ(オーバーレイは1秒、ログはもっと長い)。
+	struct Cursor {
+		qint64 time = 0;
+		quint64 channel_bytes_in[MAX_CHANNELS] = {};
+		quint64 channel_bytes_out[MAX_CHANNELS] = {};
+		quint64 channel_pdus_in[MAX_CHANNELS] = {};
+		quint64 channel_pdus_out[MAX_CHANNELS] = {};
+		quint64 codec_commands[MAX_CODECS] = {};
+		quint64 transport_sent = 0;
+		quint64 decode_nsecs = 0;
+		quint64 decode_count = 0;
+		quint64 frames = 0;
+		quint64 coalesced = 0;
+	};
+private:
+	struct Channel {
+		std::atomic<quint32> id { 0 }; // 0: 未使用
+		std::atomic<bool> named { false }; // nameを書き終えた
+		char name[8] = {};
+		std::atomic<quint64> bytes_in { 0 };
+		std::atomic<quint64> bytes_out { 0 };
+		std::atomic<quint64> pdus_in { 0 };
+		std::atomic<quint64> pdus_out { 0 };
+	};
+	Channel channels[MAX_CHANNELS];
+	std::atomic<quint64> codec_commands[MAX_CODECS] = {};
+	std::atomic<quint64> transport_sent { 0 }; // 各トランスポートが送ったバイト数の合計
+	quint64 transport_last = 0; // RDPスレッド専用: 今のトランスポートの前回の値
+	std::atomic<quint64> decode_nsecs { 0 };
+	std::atomic<quint64> decode_count { 0 };
+	std::atomic<quint64> frames { 0 };
+	std::atomic<quint64> coalesced { 0 };
+	std::atomic<quint32> rtt_ms { 0 };
+	std::atomic<quint32> bandwidth_kbps { 0 };
+
+	Channel *channel(freerdp *instance, quint16 id);
+public:
+	// 以下はどのスレッドから呼んでもよい。チャネルの名前は、そのチャネルを初めて数えるときだけinstanceから引く。
+	void recordChannelIn(freerdp *instance, quint16 id, size_t bytes);
+	void recordChannelOut(freerdp *instance, quint16 id, size_t bytes);
+	void recordTransportSent(quint64 total_bytes); // これだけはRDPスレッドから呼ぶ
+	void recordSurfaceCommand(quint32 codec_id, qint64 decode_nsecs);
+	void recordFrame(bool coalesced);
+	void recordNetwork(quint32 rtt_ms, quint32 bandwidth_kbps);
+
+	// 接続の前に、RDPスレッドが数えていない間に呼ぶ。読み出しの起点(resetした時刻)を返す。
+	Cursor reset();
+	// cursorの時点からの区間の値を返し、cursorを今の時点へ進める
+	SessionStatsSample sample(Cursor *cursor) const;
+
+	static char const *codecName(quint32 codec_id);
+};
+
+#endif // SESSIONSTATS_H
@@ -23,9 +23,9 @@ int main(int argc, char *argv[])
 
 	QApplication a(argc, argv);
 
-	MainWindow w;
-	global->mainwindow = &w;
-
-	w.show();
+	// ウィンドウはFile > New Windowで増やせる。最後のウィンドウを閉じると終了する。
+	auto *w = new MainWindow;
+	w->setAttribute(Qt::WA_DeleteOnClose);
+	w->show();
 	return a.exec();
 }
@@ -0,0 +1,171 @@
+#include "FrameRecorder.h"
+#include "FrameStats.h"
+#include "Global.h"
+#include "ImageScaler.h"
+#include "MyView.h"
+#include <QApplication>
+#include <QCommandLineParser>
+#include <QElapsedTimer>
+#include <QPainter>
+#include <QTimer>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <thread>
+#include <sys/resource.h>
+
+ApplicationGlobal *global;
+
+// 記録したフレームをMyViewへ順に流し、1フレームが表示されるまでの時間を計測する。
+// 既定では表示間隔の制御を外して最速で流す。--realtimeを付けると記録時の時刻どおりに流す。
+int main(int argc, char *argv[])
+{
+	if (qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM")) {
+		qputenv("QT_QPA_PLATFORM", "offscreen");
+	}
+
+	ApplicationGlobal g;
+	global = &g;
+
+	QApplication a(argc, argv);
+
+	QCommandLineParser parser;
+	parser.addHelpOption();
+	parser.addPositionalArgument("file", "Recorded frame file (View > Record Frames)");
+	QCommandLineOption scale_option("scale", "Display scale (1-4)", "n", "1");
+	QCommandLineOption realtime_option("realtime", "Replay at the recorded pace, paced to the display refresh rate");
+	QCommandLineOption stats_option("stats", "Write per-stage latency histograms into <dir>", "dir");
+	QCommandLineOption pixel_format_option("pixel-format", "Compose in this pixel format: bgrx32 or rgb24 (default: as recorded)", "format");
+	parser.addOption(scale_option);
+	parser.addOption(realtime_option);
+	parser.addOption(stats_option);
+	parser.addOption(pixel_format_option);
+	parser.process(a);
+	if (parser.positionalArguments().size() != 1) {
+		parser.showHelp(1);
+	}
+
+	FrameReader reader;
+	if (!reader.open(parser.positionalArguments().front()) || !reader.next()) {
+		fprintf(stderr, "failed to read frames: %s\n", qPrintable(parser.positionalArguments().front()));
+		return 1;
+	}
+
+	const int scale = std::clamp(parser.value(scale_option).toInt(), 1, 4);
+	const bool realtime = parser.isSet(realtime_option);
+
+	// 接続の設定の画素形式(BGRX32/RGB24)と同じ画面を作って、合成と表示の速さを比べる
+	QImage::Format format = reader.screen().format();
+	if (parser.isSet(pixel_format_option)) {
+		const QString name = parser.value(pixel_format_option).toLower();
+		if (name == "bgrx32") {
+			format = QImage::Format_RGB32;
+		} else if (name == "rgb24") {
+			format = QImage::Format_RGB888;
+		} else {
+			fprintf(stderr, "unknown pixel format: %s\n", qPrintable(name));
+			return 1;
+		}
+	}
+	QImage converted; // 記録と違う画素形式で流すときの画面
+
+	// MyViewは接続中のインスタンスがあるときだけ画面を描くので、接続しないインスタンスを渡す
+	freerdp *instance = freerdp_new();
+	MyView view;
+	view.setRdpInstance(instance);
+	view.setMaxFps(realtime ? 0 : -1);
+	view.setScale(scale);
+	view.resize(reader.screen().size() * scale);
+	view.show();
+
+	// paintEventが終わったことを知るためにPaintイベントを数える
+	struct PaintCounter : QObject {
+		int count = 0;
+		bool eventFilter(QObject *watched, QEvent *event) override
+		{
+			if (event->type() == QEvent::Paint) count++;
+			return false;
+		}
+	} paint_counter;
+	view.installEventFilter(&paint_counter);
+
+	// 描画が起きないまま待ち続けないように、イベントループを定期的に起こす
+	QTimer tick;
+	tick.start(100);
+
+	LatencyHistogram frame_times;
+	qint64 frame_time_sum = 0;
+	qint64 frame_time_max = 0;
+	int frames = 0;
+	int dropped = 0;
+	QElapsedTimer elapsed;
+	elapsed.start();
+	do {
+		if (reader.rects().empty()) continue;
+		if (realtime) {
+			const qint64 wait = reader.time() - elapsed.nsecsElapsed();
+			if (wait > 0) {
+				std::this_thread::sleep_for(std::chrono::nanoseconds(wait));
+			}
+		}
+		// 記録と違う画素形式は、計測を始める前に変わった範囲だけを変換しておく
+		const QImage *screen = &reader.screen();
+		if (format != screen->format()) {
+			if (converted.size() != screen->size()) {
+				converted = screen->convertToFormat(format);
+			} else {
+				QPainter pr(&converted);
+				pr.setCompositionMode(QPainter::CompositionMode_Source);
+				for (QRect const &r : reader.rects()) {
+					pr.drawImage(r.topLeft(), *screen, r);
+				}
+			}
+			screen = &converted;
+		}
+		const int paints = paint_counter.count;
+		const qint64 t0 = FrameStats::now();
+		view.setDamage(*screen, reader.rects(), t0);
+		QElapsedTimer timeout;
+		timeout.start();
+		while (paint_counter.count == paints && timeout.elapsed() < 1000) {
+			a.processEvents(QEventLoop::WaitForMoreEvents);
+		}
+		if (paint_counter.count == paints) {
+			dropped++;
+			continue;
+		}
+		const qint64 t = FrameStats::now() - t0;
+		frame_times.record(t);
+		frame_time_sum += t;
+		frame_time_max = std::max(frame_time_max, t);
+		frames++;
+	} while (reader.next());
+	const double seconds = elapsed.nsecsElapsed() / 1e9;
+	a.processEvents();
+
+	struct rusage usage = {};
+	getrusage(RUSAGE_SELF, &usage);
+
+	auto ms = [](qint64 usecs) { return usecs / 1000.0; };
+	printf("kernel:      %s\n", ImageScaler::kernelName());
+	printf("screen:      %dx%d x%d %s\n", reader.screen().width(), reader.screen().height(), scale, format == QImage::Format_RGB888 ? "RGB24" : "BGRX32");
+	printf("frames:      %d (%d not painted)\n", frames, dropped);
+	printf("elapsed:     %.3f s\n", seconds);
+	printf("frames/s:    %.1f\n", seconds > 0 ? frames / seconds : 0.0);
+	printf("frame (ms):  mean %.3f  p50 %.3f  p95 %.3f  p99 %.3f  max %.3f\n",
+		   frames > 0 ? frame_time_sum / 1e6 / frames : 0.0,
+		   ms(frame_times.percentile(0.50)), ms(frame_times.percentile(0.95)), ms(frame_times.percentile(0.99)),
+		   frame_time_max / 1e6);
+	printf("peak RSS:    %.1f MB\n", usage.ru_maxrss / 1024.0);
+
+	if (parser.isSet(stats_option)) {
+		QString path = view.saveFrameStatistics(parser.value(stats_option));
+		if (!path.isEmpty()) {
+			printf("statistics:  %s\n", qPrintable(path));
+		}
+	}
+
+	view.setRdpInstance(nullptr);
+	freerdp_free(instance);
+	return frames > 0 ? 0 : 1;
+}
@@ -0,0 +1,61 @@
+# FrameRecorderで記録したフレームを、Qtのoffscreenプラットフォーム上で
+# MyViewの合成・表示の経路へ流して計測するベンチマーク
+TARGET = radic_replay
+QT += core gui widgets
+CONFIG += c++17 console
+CONFIG -= app_bundle
+
+INCLUDEPATH += ..
+INCLUDEPATH += /usr/include/freerdp3
+INCLUDEPATH += /usr/include/winpr3
+
+LIBS += -lfreerdp3 -lfreerdp-client3 -lwinpr3
+
+gcc:QMAKE_CXXFLAGS += -Wall -Wextra -Werror=return-type -Werror=trigraphs -Wno-switch -Wno-reorder -Wno-unused-parameter
+
+SOURCES += \
+    ../ClipboardCodec.cpp \
+    ../CommandForm.cpp \
+    ../ConnectionDialog.cpp \
+    ../FrameRecorder.cpp \
+    ../FrameRing.cpp \
+    ../FrameStats.cpp \
+    ../Global.cpp \
+    ../ImageScaler.cpp \
+    ../InputQueue.cpp \
+    ../LocalClipboard.cpp \
+    ../MySettings.cpp \
+    ../MyView.cpp \
+    ../NetworkProfile.cpp \
+    ../RemoteClipboard.cpp \
+    ../SessionStats.cpp \
+    ../VerifyCertificateDialog.cpp \
+    ../MainWindow.cpp \
+    main.cpp
+
+HEADERS += \
+    ../ClipboardCodec.h \
+    ../CommandForm.h \
+    ../ConnectionDialog.h \
+    ../FrameRecorder.h \
+    ../FrameRing.h \
+    ../FrameStats.h \
+    ../Global.h \
+    ../ImageScaler.h \
+    ../InputQueue.h \
+    ../LocalClipboard.h \
+    ../MainWindow.h \
+    ../MySettings.h \
+    ../MyView.h \
+    ../NetworkProfile.h \
+    ../RemoteClipboard.h \
+    ../SessionStats.h \
+    ../VerifyCertificateDialog.h \
+    ../joinpath.h \
+    ../rdpcert.h
+
+FORMS += \
+    ../CommandForm.ui \
+    ../ConnectionDialog.ui \
+    ../MainWindow.ui \
+    ../VerifyCertificateDialog.ui
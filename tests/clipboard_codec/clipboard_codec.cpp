@@ -0,0 +1,286 @@
+#include "ClipboardCodec.h"
+#include <QRandomGenerator>
+#include <QtTest>
+#include <cstdlib>
+#include <cstring>
+#include <freerdp/freerdp.h>
+#include <freerdp/gdi/gdi.h>
+
+namespace {
+
+// ClipboardCodecへ移す前の、画素ごとにqRgbで変換していた実装(入力は正しいものとする)
+namespace reference {
+
+QByteArray imageToDib(const QImage &source)
+{
+	QImage image = source.convertToFormat(QImage::Format_RGB32);
+	const qint64 stride = static_cast<qint64>(image.width()) * 4;
+	const qint64 pixelBytes = stride * image.height();
+
+	QByteArray dib(sizeof(BITMAPINFOHEADER) + pixelBytes, Qt::Uninitialized);
+	BITMAPINFOHEADER header = {};
+	header.biSize = sizeof(BITMAPINFOHEADER);
+	header.biWidth = image.width();
+	header.biHeight = image.height();
+	header.biPlanes = 1;
+	header.biBitCount = 32;
+	header.biCompression = BI_RGB;
+	header.biSizeImage = static_cast<DWORD>(pixelBytes);
+	header.biXPelsPerMeter = image.dotsPerMeterX() > 0 ? image.dotsPerMeterX() : 3780; // 96 DPI
+	header.biYPelsPerMeter = image.dotsPerMeterY() > 0 ? image.dotsPerMeterY() : 3780;
+	memcpy(dib.data(), &header, sizeof(header));
+
+	auto *dst = reinterpret_cast<uchar *>(dib.data() + sizeof(header));
+	for (int y = 0; y < image.height(); ++y) {
+		const QRgb *src = reinterpret_cast<const QRgb *>(image.constScanLine(image.height() - 1 - y));
+		for (int x = 0; x < image.width(); ++x) {
+			dst[x * 4 + 0] = qBlue(src[x]);
+			dst[x * 4 + 1] = qGreen(src[x]);
+			dst[x * 4 + 2] = qRed(src[x]);
+			dst[x * 4 + 3] = 0;
+		}
+		dst += stride;
+	}
+	return dib;
+}
+
+QImage dibToImage(const QByteArray &dib)
+{
+	BITMAPINFOHEADER header = {};
+	memcpy(&header, dib.constData(), sizeof(header));
+	const qint64 width = header.biWidth;
+	const qint64 height = std::abs(static_cast<qint64>(header.biHeight));
+	const qint64 stride = ((width * header.biBitCount + 31) / 32) * 4;
+
+	QImage image(static_cast<int>(width), static_cast<int>(height), QImage::Format_RGB32);
+	const auto *pixels = reinterpret_cast<const uchar *>(dib.constData() + header.biSize);
+	for (int y = 0; y < image.height(); ++y) {
+		const int srcY = header.biHeight > 0 ? image.height() - 1 - y : y;
+		const uchar *src = pixels + static_cast<qint64>(srcY) * stride;
+		QRgb *dst = reinterpret_cast<QRgb *>(image.scanLine(y));
+		for (int x = 0; x < image.width(); ++x) {
+			const int offset = x * (header.biBitCount / 8);
+			dst[x] = qRgb(src[offset + 2], src[offset + 1], src[offset]);
+		}
+	}
+	return image;
+}
+
+} // namespace reference
+
+qint64 dibStride(int width, int bpp)
+{
+	return ((qint64(width) * bpp + 31) / 32) * 4;
+}
+
+// 画素(行末の詰め物と32bitの4バイト目を含む)を乱数で埋めたDIBを作る。
+// 配列は画素の末尾でちょうど終わるので、最後の行を読み過ぎればASanなどで分かる。
+QByteArray makeDib(int width, int height, int bpp, bool bottom_up, quint32 seed)
+{
+	const qint64 pixel_bytes = dibStride(width, bpp) * height;
+	QByteArray dib(sizeof(BITMAPINFOHEADER) + pixel_bytes, Qt::Uninitialized);
+	BITMAPINFOHEADER header = {};
+	header.biSize = sizeof(BITMAPINFOHEADER);
+	header.biWidth = width;
+	header.biHeight = bottom_up ? height : -height;
+	header.biPlanes = 1;
+	header.biBitCount = bpp;
+	header.biCompression = BI_RGB;
+	header.biSizeImage = static_cast<DWORD>(pixel_bytes);
+	memcpy(dib.data(), &header, sizeof(header));
+	QRandomGenerator random(seed);
+	auto *pixels = reinterpret_cast<quint32 *>(dib.data() + sizeof(header));
+	random.fillRange(pixels, pixel_bytes / 4);
+	return dib;
+}
+
+// Format_RGB32でも4バイト目は0xffとは限らないものとして、乱数で埋める
+QImage makeImage(int width, int height, quint32 seed)
+{
+	QImage image(width, height, QImage::Format_RGB32);
+	QRandomGenerator random(seed);
+	for (int y = 0; y < height; y++) {
+		random.fillRange(reinterpret_cast<quint32 *>(image.scanLine(y)), width);
+	}
+	return image;
+}
+
+// 4バイト目も含めて行ごとに比べる
+bool samePixels(QImage const &a, QImage const &b)
+{
+	if (a.size() != b.size() || a.format() != b.format()) return false;
+	for (int y = 0; y < a.height(); y++) {
+		if (memcmp(a.constScanLine(y), b.constScanLine(y), size_t(a.width()) * 4) != 0) return false;
+	}
+	return true;
+}
+
+// 並列に処理し始める大きさの前後になる高さ
+int heightBelowParallel(qint64 stride)
+{
+	return int(ClipboardCodec::PARALLEL_MIN_BYTES / stride) - 1;
+}
+
+int heightAboveParallel(qint64 stride)
+{
+	return int(ClipboardCodec::PARALLEL_MIN_BYTES / stride) + 1;
+}
+
+} // namespace
+
+class TestClipboardCodec : public QObject {
+	Q_OBJECT
+private slots:
+	void cleanup();
+	void dibToImage_data();
+	void dibToImage();
+	void imageToDib_data();
+	void imageToDib();
+	void benchmarkDibToImage_data();
+	void benchmarkDibToImage();
+	void benchmarkImageToDib_data();
+	void benchmarkImageToDib();
+};
+
+void TestClipboardCodec::cleanup()
+{
+	ClipboardCodec::setKernel(ClipboardCodec::kernelNames().front());
+}
+
+void TestClipboardCodec::dibToImage_data()
+{
+	QTest::addColumn<QString>("kernel");
+	QTest::addColumn<int>("bpp");
+	QTest::addColumn<bool>("bottom_up");
+	QTest::addColumn<int>("width");
+	QTest::addColumn<int>("height");
+
+	for (QString const &kernel : ClipboardCodec::kernelNames()) {
+		for (int bpp : {24, 32}) {
+			for (bool bottom_up : {true, false}) {
+				auto add = [&](int width, int height) {
+					const QByteArray name = QString("%1/%2bit/%3/%4x%5").arg(kernel).arg(bpp).arg(bottom_up ? "bottom-up" : "top-down").arg(width).arg(height).toUtf8();
+					QTest::newRow(name.constData()) << kernel << bpp << bottom_up << width << height;
+				};
+				// 幅1〜17で、SIMDの本体(24bitはi + 6 <= n)と端数の境目をすべて通す
+				for (int width = 1; width <= 17; width++) {
+					add(width, 3);
+				}
+				add(1023, heightBelowParallel(dibStride(1023, bpp)));
+				add(1023, heightAboveParallel(dibStride(1023, bpp)));
+			}
+		}
+	}
+}
+
+void TestClipboardCodec::dibToImage()
+{
+	QFETCH(QString, kernel);
+	QFETCH(int, bpp);
+	QFETCH(bool, bottom_up);
+	QFETCH(int, width);
+	QFETCH(int, height);
+
+	QVERIFY(ClipboardCodec::setKernel(kernel));
+	const QByteArray dib = makeDib(width, height, bpp, bottom_up, quint32(width * 131 + height));
+	const QImage expected = reference::dibToImage(dib);
+	const QImage actual = ClipboardCodec::dibToImage(dib);
+	QVERIFY(!actual.isNull());
+	QVERIFY(samePixels(actual, expected));
+}
+
+void TestClipboardCodec::imageToDib_data()
+{
+	QTest::addColumn<QString>("kernel");
+	QTest::addColumn<int>("width");
+	QTest::addColumn<int>("height");
+
+	for (QString const &kernel : ClipboardCodec::kernelNames()) {
+		auto add = [&](int width, int height) {
+			const QByteArray name = QString("%1/%2x%3").arg(kernel).arg(width).arg(height).toUtf8();
+			QTest::newRow(name.constData()) << kernel << width << height;
+		};
+		for (int width = 1; width <= 17; width++) {
+			add(width, 3);
+		}
+		add(1023, heightBelowParallel(dibStride(1023, 32)));
+		add(1023, heightAboveParallel(dibStride(1023, 32)));
+	}
+}
+
+void TestClipboardCodec::imageToDib()
+{
+	QFETCH(QString, kernel);
+	QFETCH(int, width);
+	QFETCH(int, height);
+
+	QVERIFY(ClipboardCodec::setKernel(kernel));
+	const QImage image = makeImage(width, height, quint32(width * 131 + height));
+	const QByteArray expected = reference::imageToDib(image);
+	const QByteArray actual = ClipboardCodec::imageToDib(image);
+	QCOMPARE(actual.size(), expected.size());
+	QVERIFY(actual == expected);
+}
+
+// 4Kの画面1枚分。"reference"は従来の実装。
+void TestClipboardCodec::benchmarkDibToImage_data()
+{
+	QTest::addColumn<QString>("kernel");
+	QTest::addColumn<int>("bpp");
+
+	for (int bpp : {24, 32}) {
+		QTest::newRow(QString("reference/%1bit").arg(bpp).toUtf8().constData()) << QString() << bpp;
+		for (QString const &kernel : ClipboardCodec::kernelNames()) {
+			QTest::newRow(QString("%1/%2bit").arg(kernel).arg(bpp).toUtf8().constData()) << kernel << bpp;
+		}
+	}
+}
+
+void TestClipboardCodec::benchmarkDibToImage()
+{
+	QFETCH(QString, kernel);
+	QFETCH(int, bpp);
+
+	const QByteArray dib = makeDib(3840, 2160, bpp, true, 1);
+	if (kernel.isEmpty()) {
+		QBENCHMARK {
+			reference::dibToImage(dib);
+		}
+	} else {
+		QVERIFY(ClipboardCodec::setKernel(kernel));
+		QBENCHMARK {
+			ClipboardCodec::dibToImage(dib);
+		}
+	}
+}
+
+void TestClipboardCodec::benchmarkImageToDib_data()
+{
+	QTest::addColumn<QString>("kernel");
+
+	QTest::newRow("reference") << QString();
+	for (QString const &kernel : ClipboardCodec::kernelNames()) {
+		QTest::newRow(kernel.toUtf8().constData()) << kernel;
+	}
+}
+
+void TestClipboardCodec::benchmarkImageToDib()
+{
+	QFETCH(QString, kernel);
+
+	const QImage image = makeImage(3840, 2160, 1);
+	if (kernel.isEmpty()) {
+		QBENCHMARK {
+			reference::imageToDib(image);
+		}
+	} else {
+		QVERIFY(ClipboardCodec::setKernel(kernel));
+		QBENCHMARK {
+			ClipboardCodec::imageToDib(image);
+		}
+	}
+}
+
+QTEST_APPLESS_MAIN(TestClipboardCodec)
+
+#include "clipboard_codec.moc"
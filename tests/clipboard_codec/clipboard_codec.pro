@@ -0,0 +1,20 @@
+# ClipboardCodecのDIBの変換を、カーネルごとに従来の画素ごとの変換と比べるテストと計測
+TARGET = clipboard_codec
+QT += core gui testlib
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+INCLUDEPATH += /usr/include/freerdp3
+INCLUDEPATH += /usr/include/winpr3
+
+LIBS += -lfreerdp3 -lwinpr3
+
+gcc:QMAKE_CXXFLAGS += -Wall -Wextra -Werror=return-type -Werror=trigraphs -Wno-switch -Wno-reorder -Wno-unused-parameter
+
+SOURCES += \
+    ../../ClipboardCodec.cpp \
+    clipboard_codec.cpp
+
+HEADERS += \
+    ../../ClipboardCodec.h
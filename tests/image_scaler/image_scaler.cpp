@@ -0,0 +1,163 @@
+#include "ImageScaler.h"
+#include <QRandomGenerator>
+#include <QtTest>
+#include <cstring>
+#include <vector>
+
+namespace {
+
+constexpr uint32_t GUARD = 0xdeadbeefu; // 書き過ぎを見つけるために出力の後ろに置く値
+
+void expandRow32Reference(uint32_t *dst, uint32_t const *src, int n, int factor)
+{
+	for (int i = 0; i < n; i++) {
+		for (int k = 0; k < factor; k++) {
+			*dst++ = src[i];
+		}
+	}
+}
+
+QImage makeImage(int width, int height, QImage::Format format, quint32 seed)
+{
+	QImage image(width, height, format);
+	QRandomGenerator random(seed);
+	for (int y = 0; y < height; y++) {
+		uchar *line = image.scanLine(y);
+		for (int i = 0; i < image.bytesPerLine(); i++) {
+			line[i] = uchar(random.generate());
+		}
+	}
+	return image;
+}
+
+// factor倍した画像の、rectに対応する範囲を比べる
+bool sameScaled(QImage const &actual, QImage const &src, QRect const &rect, int factor)
+{
+	const int bpp = src.depth() / 8;
+	for (int y = rect.top() * factor; y < (rect.bottom() + 1) * factor; y++) {
+		uchar const *s = src.constScanLine(y / factor);
+		uchar const *d = actual.constScanLine(y);
+		for (int x = rect.left() * factor; x < (rect.right() + 1) * factor; x++) {
+			if (memcmp(d + x * bpp, s + (x / factor) * bpp, bpp) != 0) return false;
+		}
+	}
+	return true;
+}
+
+} // namespace
+
+class TestImageScaler : public QObject {
+	Q_OBJECT
+private slots:
+	void cleanup();
+	void expandRow32_data();
+	void expandRow32();
+	void scale_data();
+	void scale();
+	void benchmarkExpandRow32_data();
+	void benchmarkExpandRow32();
+};
+
+void TestImageScaler::cleanup()
+{
+	ImageScaler::setKernel(ImageScaler::kernelNames().front());
+}
+
+void TestImageScaler::expandRow32_data()
+{
+	QTest::addColumn<QString>("kernel");
+	QTest::addColumn<int>("factor");
+
+	for (QString const &kernel : ImageScaler::kernelNames()) {
+		// 1と5はSIMDの対象外(スカラーに任せる)
+		for (int factor = 1; factor <= 5; factor++) {
+			QTest::newRow(QString("%1/%2x").arg(kernel).arg(factor).toUtf8().constData()) << kernel << factor;
+		}
+	}
+}
+
+void TestImageScaler::expandRow32()
+{
+	QFETCH(QString, kernel);
+	QFETCH(int, factor);
+
+	QVERIFY(ImageScaler::setKernel(kernel));
+	QRandomGenerator random(quint32(factor));
+	// 幅0〜40で、AVX2(8画素)とSSE2(4画素)の本体と端数の組み合わせをすべて通す
+	for (int n = 0; n <= 40; n++) {
+		std::vector<uint32_t> src(n);
+		random.fillRange(src.data(), src.size());
+		std::vector<uint32_t> expected(n * factor + 1, GUARD);
+		std::vector<uint32_t> actual(n * factor + 1, GUARD);
+		expandRow32Reference(expected.data(), src.data(), n, factor);
+		ImageScaler::expandRow32(actual.data(), src.data(), n, factor);
+		QVERIFY2(actual == expected, qPrintable(QString("width %1").arg(n)));
+	}
+}
+
+void TestImageScaler::scale_data()
+{
+	QTest::addColumn<QString>("kernel");
+	QTest::addColumn<int>("format");
+	QTest::addColumn<int>("factor");
+
+	for (QString const &kernel : ImageScaler::kernelNames()) {
+		for (QImage::Format format : {QImage::Format_RGB32, QImage::Format_RGB888}) {
+			for (int factor = 2; factor <= 4; factor++) {
+				const QByteArray name = QString("%1/%2bit/%3x").arg(kernel).arg(format == QImage::Format_RGB32 ? 32 : 24).arg(factor).toUtf8();
+				QTest::newRow(name.constData()) << kernel << int(format) << factor;
+			}
+		}
+	}
+}
+
+void TestImageScaler::scale()
+{
+	QFETCH(QString, kernel);
+	QFETCH(int, format);
+	QFETCH(int, factor);
+
+	QVERIFY(ImageScaler::setKernel(kernel));
+	const QImage src = makeImage(67, 23, QImage::Format(format), quint32(factor));
+	QImage dst(src.size() * factor, src.format());
+	dst.fill(0);
+	// 端数の出る幅と、左上が0でない範囲
+	const QRect rect(3, 2, 37, 17);
+	ImageScaler::scale(&dst, src, rect, factor);
+	QVERIFY(sameScaled(dst, src, rect, factor));
+}
+
+// 1920画素の行を1080回拡大する(1080pの画面1枚分の横方向の処理)
+void TestImageScaler::benchmarkExpandRow32_data()
+{
+	QTest::addColumn<QString>("kernel");
+	QTest::addColumn<int>("factor");
+
+	for (int factor = 2; factor <= 4; factor++) {
+		for (QString const &kernel : ImageScaler::kernelNames()) {
+			QTest::newRow(QString("%1/%2x").arg(kernel).arg(factor).toUtf8().constData()) << kernel << factor;
+		}
+	}
+}
+
+void TestImageScaler::benchmarkExpandRow32()
+{
+	QFETCH(QString, kernel);
+	QFETCH(int, factor);
+
+	QVERIFY(ImageScaler::setKernel(kernel));
+	constexpr int WIDTH = 1920;
+	constexpr int HEIGHT = 1080;
+	std::vector<uint32_t> src(WIDTH);
+	QRandomGenerator(1).fillRange(src.data(), src.size());
+	std::vector<uint32_t> dst(WIDTH * factor);
+	QBENCHMARK {
+		for (int y = 0; y < HEIGHT; y++) {
+			ImageScaler::expandRow32(dst.data(), src.data(), WIDTH, factor);
+		}
+	}
+}
+
+QTEST_APPLESS_MAIN(TestImageScaler)
+
+#include "image_scaler.moc"
@@ -0,0 +1,16 @@
+# ImageScalerの行の拡大を、カーネルごとにスカラー版と比べるテストと計測
+TARGET = image_scaler
+QT += core gui testlib
+CONFIG += c++17 console testcase
+CONFIG -= app_bundle
+
+INCLUDEPATH += ../..
+
+gcc:QMAKE_CXXFLAGS += -Wall -Wextra -Werror=return-type -Werror=trigraphs -Wno-switch -Wno-reorder -Wno-unused-parameter
+
+SOURCES += \
+    ../../ImageScaler.cpp \
+    image_scaler.cpp
+
+HEADERS += \
+    ../../ImageScaler.h
@@ -0,0 +1,5 @@
+# SIMDのカーネルのテストと計測。make checkで両方を実行する。
+TEMPLATE = subdirs
+SUBDIRS += \
+    clipboard_codec \
+    image_scaler